@@ -0,0 +1,159 @@
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "pixel_format.h"
+
+const std::string USAGE =
+    "./blend_bench [options]\n"
+    "Measures the throughput of the blending kernels used by the native compositors,\n"
+    "writing to a separate image and in place front-to-back and back-to-front.\n"
+    "Options:\n"
+    "  -sizes <list>        Image sizes to blend, as a comma separated list of square image\n"
+    "                       widths (default 256,1024,2048,4096).\n"
+    "  -sparsity <list>     Fractions of fully transparent pixels in the images, as a comma\n"
+    "                       separated list (default 0,0.5,0.9,0.99).\n"
+    "  -iters <n>           Number of timed iterations per kernel (default 20).\n"
+    "  -h                   Print this help.";
+
+template <typename T>
+std::vector<T> parse_list(const std::string &str)
+{
+    std::vector<T> vals;
+    std::stringstream ss(str);
+    std::string v;
+    while (std::getline(ss, v, ',')) {
+        T x;
+        std::stringstream(v) >> x;
+        vals.push_back(x);
+    }
+    return vals;
+}
+
+// Generate random premultiplied pixels, with the sparsity fraction of them empty
+template <typename Pixel>
+std::vector<Pixel> generate_pixels(const size_t n, const float sparsity, std::mt19937 &rng)
+{
+    std::uniform_real_distribution<float> dist(0.f, 1.f);
+    std::vector<Pixel> pixels(n, make_pixel<Pixel>(vec4f(0.f)));
+    for (auto &p : pixels) {
+        if (dist(rng) < sparsity) {
+            continue;
+        }
+        const float alpha = dist(rng);
+        const vec3f color(dist(rng), dist(rng), dist(rng));
+        p = make_pixel<Pixel>(vec4f(color * alpha, alpha));
+    }
+    return pixels;
+}
+
+// Where the kernel writes the blended pixels: a separate image, or in place over the
+// front image when accumulating front-to-back or the back image when accumulating
+// back-to-front, as done by the compositors
+enum class BlendOutput { SEPARATE, FRONT, BACK };
+
+/* Time the kernel blending the back image under the front one, returning the best
+ * throughput in GB/s over the iterations. Each pixel blended reads the front and back
+ * pixels and writes the result, also when the result overwrites one of them. The out
+ * image is used as the in place front or back image, and is reset to its pixels
+ * before each iteration
+ */
+template <typename Pixel, typename F>
+double time_kernel(const std::vector<Pixel> &front,
+                   const std::vector<Pixel> &back,
+                   std::vector<Pixel> &out,
+                   const BlendOutput output,
+                   const int iters,
+                   const F &kernel)
+{
+    using namespace std::chrono;
+    double best_time = std::numeric_limits<double>::infinity();
+    const Pixel *f = output == BlendOutput::FRONT ? out.data() : front.data();
+    const Pixel *b = output == BlendOutput::BACK ? out.data() : back.data();
+    // One untimed iteration to warm up the caches and TBB threads
+    for (int i = 0; i < iters + 1; ++i) {
+        if (output == BlendOutput::FRONT) {
+            std::copy(front.begin(), front.end(), out.begin());
+        } else if (output == BlendOutput::BACK) {
+            std::copy(back.begin(), back.end(), out.begin());
+        }
+        const auto start = high_resolution_clock::now();
+        kernel(f, b, out.data(), front.size());
+        const auto end = high_resolution_clock::now();
+        if (i > 0) {
+            best_time =
+                std::min(best_time, duration_cast<duration<double>>(end - start).count());
+        }
+    }
+    const double bytes = 3.0 * front.size() * sizeof(Pixel);
+    return bytes / best_time * 1e-9;
+}
+
+template <typename Pixel>
+void run_benchmarks(const PixelFormat format,
+                    const std::vector<int> &sizes,
+                    const std::vector<float> &sparsities,
+                    const int iters)
+{
+    std::mt19937 rng(5);
+    for (const auto &size : sizes) {
+        const size_t n = size_t(size) * size;
+        std::vector<Pixel> out(n, make_pixel<Pixel>(vec4f(0.f)));
+        for (const auto &sparsity : sparsities) {
+            const std::vector<Pixel> front = generate_pixels<Pixel>(n, sparsity, rng);
+            const std::vector<Pixel> back = generate_pixels<Pixel>(n, sparsity, rng);
+
+            auto span_kernel = [](const Pixel *f, const Pixel *b, Pixel *o, size_t c) {
+                blend_span(f, b, o, c);
+            };
+            auto report = [&](const std::string &name, const auto &kernel) {
+                const double separate_gbs =
+                    time_kernel(front, back, out, BlendOutput::SEPARATE, iters, kernel);
+                const double front_gbs =
+                    time_kernel(front, back, out, BlendOutput::FRONT, iters, kernel);
+                const double back_gbs =
+                    time_kernel(front, back, out, BlendOutput::BACK, iters, kernel);
+                std::cout << pixel_format_name(format) << " " << size << "x" << size
+                          << " sparsity " << sparsity << " " << name << ": separate "
+                          << separate_gbs << "GB/s, front-to-back " << front_gbs
+                          << "GB/s, back-to-front " << back_gbs << "GB/s\n";
+            };
+            report("blend_span", span_kernel);
+            report("blend_images", blend_images<Pixel>);
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    std::vector<int> sizes = {256, 1024, 2048, 4096};
+    std::vector<float> sparsities = {0.f, 0.5f, 0.9f, 0.99f};
+    int iters = 20;
+
+    const std::vector<std::string> args(argv, argv + argc);
+    for (size_t i = 1; i < args.size(); ++i) {
+        if (args[i] == "-sizes") {
+            sizes = parse_list<int>(args[++i]);
+        } else if (args[i] == "-sparsity") {
+            sparsities = parse_list<float>(args[++i]);
+        } else if (args[i] == "-iters") {
+            iters = std::stoi(args[++i]);
+        } else if (args[i] == "-h") {
+            std::cout << USAGE << "\n";
+            return 0;
+        } else {
+            std::cerr << "[error]: Unknown option " << args[i] << "\n";
+            std::cout << USAGE << "\n";
+            return 1;
+        }
+    }
+
+    run_benchmarks<uint32_t>(PixelFormat::RGBA8, sizes, sparsities, iters);
+    run_benchmarks<RGBA16F>(PixelFormat::RGBA16F, sizes, sparsities, iters);
+    run_benchmarks<vec4f>(PixelFormat::RGBA32F, sizes, sparsities, iters);
+    return 0;
+}
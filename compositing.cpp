@@ -0,0 +1,1115 @@
+#include "compositing.h"
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <tbb/parallel_for.h>
+
+bool CompositeOptions::lossy() const
+{
+    return error_bound.x > 0.f || error_bound.y > 0.f || error_bound.z > 0.f ||
+           error_bound.w > 0.f;
+}
+
+bool CompositeOptions::encoded() const
+{
+    return rle || lossy();
+}
+
+static size_t num_chunks(const size_t n)
+{
+    return (n + ENCODE_CHUNK_PIXELS - 1) / ENCODE_CHUNK_PIXELS;
+}
+
+/* Encode the chunks of the pixels in parallel into max size slots in the output,
+ * then compact them down. The slots fit in the output since it has the max encoded
+ * size for the encoding
+ */
+template <typename Pixel, typename F>
+static size_t encode_chunks(const Pixel *pixels,
+                            const size_t n,
+                            const size_t max_chunk_size,
+                            uint32_t *out,
+                            const F &encode_chunk)
+{
+    const size_t n_chunks = num_chunks(n);
+    tbb::parallel_for(size_t(0), n_chunks, [&](const size_t c) {
+        const size_t begin = c * ENCODE_CHUNK_PIXELS;
+        const size_t end = std::min(begin + ENCODE_CHUNK_PIXELS, n);
+        encode_chunk(pixels + begin, end - begin, out + c * max_chunk_size);
+    });
+
+    size_t size = 0;
+    for (size_t c = 0; c < n_chunks; ++c) {
+        const uint32_t *chunk = out + c * max_chunk_size;
+        const uint32_t chunk_size = chunk[0];
+        std::memmove(out + size, chunk, chunk_size * sizeof(uint32_t));
+        size += chunk_size;
+    }
+    return size;
+}
+
+// Find where each chunk of the encoded pixels starts
+static std::vector<const uint32_t *> find_encoded_chunks(const uint32_t *encoded,
+                                                         const size_t n)
+{
+    std::vector<const uint32_t *> chunks(num_chunks(n), nullptr);
+    for (size_t c = 0; c < chunks.size(); ++c) {
+        chunks[c] = encoded;
+        encoded += encoded[0];
+    }
+    return chunks;
+}
+
+template <typename Pixel>
+size_t max_rle_size(const size_t n)
+{
+    // Each chunk has its size and at most one more run than it has empty pixels
+    return n * pixel_words<Pixel>() + 2 * num_chunks(n);
+}
+
+template <typename Pixel>
+static size_t rle_chunk(const Pixel *pixels, const size_t n, uint32_t *out)
+{
+    size_t size = 1;
+    for (size_t i = 0; i < n;) {
+        uint32_t empty = 0;
+        for (; i < n && pixel_empty(pixels[i]); ++i) {
+            ++empty;
+        }
+        uint32_t active = 0;
+        while (i + active < n && !pixel_empty(pixels[i + active])) {
+            ++active;
+        }
+        out[size] = empty | (active << 16);
+        std::memcpy(out + size + 1, pixels + i, active * sizeof(Pixel));
+        size += 1 + active * pixel_words<Pixel>();
+        i += active;
+    }
+    out[0] = size;
+    return size;
+}
+
+template <typename Pixel>
+size_t encode_active_pixels(const Pixel *pixels, const size_t n, uint32_t *out)
+{
+    return encode_chunks(pixels,
+                         n,
+                         max_rle_size<Pixel>(ENCODE_CHUNK_PIXELS),
+                         out,
+                         [](const Pixel *chunk, const size_t count, uint32_t *chunk_out) {
+                             return rle_chunk(chunk, count, chunk_out);
+                         });
+}
+
+template <typename Pixel>
+void decode_active_pixels(const uint32_t *encoded, const size_t n, Pixel *out)
+{
+    const auto chunks = find_encoded_chunks(encoded, n);
+    tbb::parallel_for(size_t(0), chunks.size(), [&](const size_t c) {
+        const uint32_t *chunk = chunks[c];
+        Pixel *chunk_out = out + c * ENCODE_CHUNK_PIXELS;
+        const uint32_t size = chunk[0];
+        for (uint32_t i = 1; i < size;) {
+            const uint32_t empty = chunk[i] & 0xffff;
+            const uint32_t active = chunk[i] >> 16;
+            std::memset(static_cast<void *>(chunk_out), 0, empty * sizeof(Pixel));
+            std::memcpy(
+                static_cast<void *>(chunk_out + empty), chunk + i + 1, active * sizeof(Pixel));
+            chunk_out += empty + active;
+            i += 1 + active * pixel_words<Pixel>();
+        }
+    });
+}
+
+template <typename Pixel>
+void blend_active_pixels_under(Pixel *front, const uint32_t *encoded, const size_t n)
+{
+    const auto chunks = find_encoded_chunks(encoded, n);
+    tbb::parallel_for(size_t(0), chunks.size(), [&](const size_t c) {
+        const uint32_t *chunk = chunks[c];
+        Pixel *chunk_front = front + c * ENCODE_CHUNK_PIXELS;
+        const uint32_t size = chunk[0];
+        for (uint32_t i = 1; i < size;) {
+            const uint32_t empty = chunk[i] & 0xffff;
+            const uint32_t active = chunk[i] >> 16;
+            chunk_front += empty;
+            const Pixel *back = reinterpret_cast<const Pixel *>(chunk + i + 1);
+            blend_span(chunk_front, back, chunk_front, active);
+            chunk_front += active;
+            i += 1 + active * pixel_words<Pixel>();
+        }
+    });
+}
+
+// The header word of a fully empty quantized block
+const uint32_t EMPTY_BLOCK = 0xffffffff;
+
+static size_t num_blocks(const size_t n)
+{
+    return (n + QUANTIZE_BLOCK_PIXELS - 1) / QUANTIZE_BLOCK_PIXELS;
+}
+
+// Writes values of up to 32 bits packed one after the other into words
+struct BitWriter {
+    uint32_t *out;
+    uint64_t buffer = 0;
+    uint32_t buffered_bits = 0;
+
+    BitWriter(uint32_t *out) : out(out) {}
+
+    void write(const uint32_t value, const uint32_t bits)
+    {
+        if (bits == 0) {
+            return;
+        }
+        buffer |= uint64_t(value) << buffered_bits;
+        buffered_bits += bits;
+        if (buffered_bits >= 32) {
+            *out++ = uint32_t(buffer);
+            buffer >>= 32;
+            buffered_bits -= 32;
+        }
+    }
+
+    // Write out any partially filled word, returns the end of the written words
+    uint32_t *flush()
+    {
+        if (buffered_bits > 0) {
+            *out++ = uint32_t(buffer);
+            buffer = 0;
+            buffered_bits = 0;
+        }
+        return out;
+    }
+};
+
+struct BitReader {
+    const uint32_t *in;
+    uint64_t buffer = 0;
+    uint32_t buffered_bits = 0;
+
+    BitReader(const uint32_t *in) : in(in) {}
+
+    uint32_t read(const uint32_t bits)
+    {
+        if (bits == 0) {
+            return 0;
+        }
+        if (buffered_bits < bits) {
+            buffer |= uint64_t(*in++) << buffered_bits;
+            buffered_bits += 32;
+        }
+        const uint32_t value = uint32_t(buffer & ((uint64_t(1) << bits) - 1));
+        buffer >>= bits;
+        buffered_bits -= bits;
+        return value;
+    }
+
+    // Skip the rest of the partially read word, returns the next unread word
+    const uint32_t *finish() const
+    {
+        return in;
+    }
+};
+
+template <typename Pixel>
+size_t max_quantized_size(const size_t n)
+{
+    // Each block has a header and min per channel, and at most 32 bits per channel
+    return num_chunks(n) + 5 * num_blocks(n) + 4 * n;
+}
+
+// Quantize the offset from the block min to a number of steps, clamped to the largest
+// float below 2^32 so it stays convertible for tiny error bounds
+static uint32_t quantize_offset(const float offset, const float step)
+{
+    return uint32_t(std::min(std::round(offset / step), 4294967040.f));
+}
+
+template <typename Pixel>
+static size_t quantize_chunk(const Pixel *pixels,
+                             const size_t n,
+                             const vec4f &error_bound,
+                             uint32_t *out)
+{
+    const vec4f step = 2.f * error_bound;
+    size_t size = 1;
+    std::array<vec4f, QUANTIZE_BLOCK_PIXELS> values;
+    for (size_t b = 0; b < n; b += QUANTIZE_BLOCK_PIXELS) {
+        const size_t count = std::min(QUANTIZE_BLOCK_PIXELS, n - b);
+        bool empty = true;
+        vec4f lo(std::numeric_limits<float>::infinity());
+        vec4f hi(-std::numeric_limits<float>::infinity());
+        for (size_t i = 0; i < count; ++i) {
+            empty = empty && pixel_empty(pixels[b + i]);
+            values[i] = min(max(pixel_channels(pixels[b + i]), vec4f(0.f)), vec4f(1.f));
+            lo = min(lo, values[i]);
+            hi = max(hi, values[i]);
+        }
+        if (empty) {
+            out[size++] = EMPTY_BLOCK;
+            continue;
+        }
+
+        // The bits needed for each channel's quantized offsets from the block min
+        uint32_t header = 0;
+        std::array<uint32_t, 4> bits = {0, 0, 0, 0};
+        for (int c = 0; c < 4; ++c) {
+            // Channels without an error bound are stored losslessly as their raw floats
+            if (step[c] == 0.f) {
+                bits[c] = 32;
+            } else {
+                const uint32_t levels = quantize_offset(hi[c] - lo[c], step[c]);
+                while (bits[c] < 32 && (uint64_t(1) << bits[c]) <= levels) {
+                    ++bits[c];
+                }
+            }
+            header |= bits[c] << (8 * c);
+        }
+        out[size] = header;
+        std::memcpy(out + size + 1, &lo.x, 4 * sizeof(float));
+
+        BitWriter writer(out + size + 5);
+        for (size_t i = 0; i < count; ++i) {
+            for (int c = 0; c < 4; ++c) {
+                uint32_t q = 0;
+                if (step[c] == 0.f) {
+                    std::memcpy(&q, &values[i][c], sizeof(float));
+                } else {
+                    q = quantize_offset(values[i][c] - lo[c], step[c]);
+                }
+                writer.write(q, bits[c]);
+            }
+        }
+        size = writer.flush() - out;
+    }
+    out[0] = size;
+    return size;
+}
+
+/* Decode the blocks of the quantized chunk, calling block_fn with the offset of each
+ * block in the chunk, its pixel count and the decoded pixels, or nullptr if the block
+ * is empty
+ */
+template <typename Pixel, typename F>
+static void dequantize_chunk(const uint32_t *chunk,
+                             const size_t n,
+                             const vec4f &error_bound,
+                             const F &block_fn)
+{
+    const vec4f step = 2.f * error_bound;
+    std::array<Pixel, QUANTIZE_BLOCK_PIXELS> block;
+    const uint32_t *in = chunk + 1;
+    for (size_t b = 0; b < n; b += QUANTIZE_BLOCK_PIXELS) {
+        const size_t count = std::min(QUANTIZE_BLOCK_PIXELS, n - b);
+        const uint32_t header = *in++;
+        if (header == EMPTY_BLOCK) {
+            block_fn(b, count, nullptr);
+            continue;
+        }
+        vec4f lo;
+        std::memcpy(&lo.x, in, 4 * sizeof(float));
+        in += 4;
+
+        BitReader reader(in);
+        for (size_t i = 0; i < count; ++i) {
+            vec4f v;
+            for (int c = 0; c < 4; ++c) {
+                const uint32_t q = reader.read((header >> (8 * c)) & 0xff);
+                if (step[c] == 0.f) {
+                    std::memcpy(&v[c], &q, sizeof(float));
+                } else {
+                    v[c] = lo[c] + q * step[c];
+                }
+            }
+            block[i] = make_pixel<Pixel>(v);
+        }
+        in = reader.finish();
+        block_fn(b, count, block.data());
+    }
+}
+
+template <typename Pixel>
+size_t quantize_pixels(const Pixel *pixels,
+                       const size_t n,
+                       const vec4f &error_bound,
+                       uint32_t *out)
+{
+    return encode_chunks(pixels,
+                         n,
+                         max_quantized_size<Pixel>(ENCODE_CHUNK_PIXELS),
+                         out,
+                         [&](const Pixel *chunk, const size_t count, uint32_t *chunk_out) {
+                             return quantize_chunk(chunk, count, error_bound, chunk_out);
+                         });
+}
+
+template <typename Pixel>
+void dequantize_pixels(const uint32_t *encoded,
+                       const size_t n,
+                       const vec4f &error_bound,
+                       Pixel *out)
+{
+    const auto chunks = find_encoded_chunks(encoded, n);
+    tbb::parallel_for(size_t(0), chunks.size(), [&](const size_t c) {
+        const size_t chunk_begin = c * ENCODE_CHUNK_PIXELS;
+        const size_t chunk_pixels = std::min(ENCODE_CHUNK_PIXELS, n - chunk_begin);
+        Pixel *chunk_out = out + chunk_begin;
+        dequantize_chunk<Pixel>(
+            chunks[c],
+            chunk_pixels,
+            error_bound,
+            [&](const size_t b, const size_t count, const Pixel *block) {
+                if (block) {
+                    std::copy(block, block + count, chunk_out + b);
+                } else {
+                    std::fill(chunk_out + b,
+                              chunk_out + b + count,
+                              make_pixel<Pixel>(vec4f(0.f)));
+                }
+            });
+    });
+}
+
+template <typename Pixel>
+void blend_quantized_under(Pixel *front,
+                           const uint32_t *encoded,
+                           const size_t n,
+                           const vec4f &error_bound)
+{
+    const auto chunks = find_encoded_chunks(encoded, n);
+    tbb::parallel_for(size_t(0), chunks.size(), [&](const size_t c) {
+        const size_t chunk_begin = c * ENCODE_CHUNK_PIXELS;
+        const size_t chunk_pixels = std::min(ENCODE_CHUNK_PIXELS, n - chunk_begin);
+        Pixel *chunk_front = front + chunk_begin;
+        dequantize_chunk<Pixel>(
+            chunks[c],
+            chunk_pixels,
+            error_bound,
+            [&](const size_t b, const size_t count, const Pixel *block) {
+                if (block) {
+                    blend_span(chunk_front + b, block, chunk_front + b, count);
+                }
+            });
+    });
+}
+
+template <typename Pixel>
+size_t max_encoded_size(const size_t n, const CompositeOptions &options)
+{
+    if (options.lossy()) {
+        return max_quantized_size<Pixel>(n);
+    } else if (options.rle) {
+        return max_rle_size<Pixel>(n);
+    }
+    return n * pixel_words<Pixel>();
+}
+
+template <typename Pixel>
+size_t encode_pixels(const Pixel *pixels,
+                     const size_t n,
+                     const CompositeOptions &options,
+                     uint32_t *out)
+{
+    if (options.lossy()) {
+        return quantize_pixels(pixels, n, options.error_bound, out);
+    } else if (options.rle) {
+        return encode_active_pixels(pixels, n, out);
+    }
+    std::memcpy(out, pixels, n * sizeof(Pixel));
+    return n * pixel_words<Pixel>();
+}
+
+template <typename Pixel>
+void decode_pixels(const uint32_t *encoded,
+                   const size_t n,
+                   const CompositeOptions &options,
+                   Pixel *out)
+{
+    if (options.lossy()) {
+        dequantize_pixels(encoded, n, options.error_bound, out);
+    } else if (options.rle) {
+        decode_active_pixels(encoded, n, out);
+    } else {
+        std::memcpy(static_cast<void *>(out), encoded, n * sizeof(Pixel));
+    }
+}
+
+template <typename Pixel>
+void blend_encoded_under(Pixel *front,
+                         const uint32_t *encoded,
+                         const size_t n,
+                         const CompositeOptions &options)
+{
+    if (options.lossy()) {
+        blend_quantized_under(front, encoded, n, options.error_bound);
+    } else if (options.rle) {
+        blend_active_pixels_under(front, encoded, n);
+    } else {
+        blend_images(front, reinterpret_cast<const Pixel *>(encoded), front, n);
+    }
+}
+
+static size_t delta_mask_words(const size_t n)
+{
+    const size_t n_tiles = (n + DELTA_TILE_PIXELS - 1) / DELTA_TILE_PIXELS;
+    return (n_tiles + 31) / 32;
+}
+
+template <typename Pixel>
+size_t max_delta_size(const size_t n, const CompositeOptions &options)
+{
+    return delta_mask_words(n) + max_encoded_size<Pixel>(n, options);
+}
+
+template <typename Pixel>
+size_t encode_delta(const Pixel *pixels,
+                    const Pixel *prev,
+                    const size_t n,
+                    const CompositeOptions &options,
+                    uint32_t *out,
+                    size_t &unchanged)
+{
+    const size_t mask_words = delta_mask_words(n);
+    std::fill(out, out + mask_words, 0);
+    std::vector<Pixel> changed;
+    unchanged = 0;
+    for (size_t t = 0, begin = 0; begin < n; ++t, begin += DELTA_TILE_PIXELS) {
+        const size_t count = std::min(DELTA_TILE_PIXELS, n - begin);
+        if (std::memcmp(pixels + begin, prev + begin, count * sizeof(Pixel)) == 0) {
+            unchanged += count;
+            continue;
+        }
+        out[t / 32] |= 1u << (t % 32);
+        changed.insert(changed.end(), pixels + begin, pixels + begin + count);
+    }
+    return mask_words +
+           encode_pixels(changed.data(), changed.size(), options, out + mask_words);
+}
+
+template <typename Pixel>
+void decode_delta(const uint32_t *encoded,
+                  const size_t n,
+                  const CompositeOptions &options,
+                  Pixel *pixels)
+{
+    const size_t mask_words = delta_mask_words(n);
+    auto tile_changed = [&](const size_t t) { return (encoded[t / 32] >> (t % 32)) & 1; };
+    size_t n_changed = 0;
+    for (size_t t = 0, begin = 0; begin < n; ++t, begin += DELTA_TILE_PIXELS) {
+        if (tile_changed(t)) {
+            n_changed += std::min(DELTA_TILE_PIXELS, n - begin);
+        }
+    }
+
+    std::vector<Pixel> changed(n_changed);
+    decode_pixels(encoded + mask_words, n_changed, options, changed.data());
+    size_t offset = 0;
+    for (size_t t = 0, begin = 0; begin < n; ++t, begin += DELTA_TILE_PIXELS) {
+        if (tile_changed(t)) {
+            const size_t count = std::min(DELTA_TILE_PIXELS, n - begin);
+            std::copy(changed.begin() + offset,
+                      changed.begin() + offset + count,
+                      pixels + begin);
+            offset += count;
+        }
+    }
+}
+
+int CompositeRound::max_k() const
+{
+    return *std::max_element(merge_counts.begin(), merge_counts.end());
+}
+
+std::vector<CompositeRound> binary_swap_schedule(const int num_ranks)
+{
+    std::vector<CompositeRound> schedule;
+    int swap_ranks = 1;
+    while (swap_ranks * 2 <= num_ranks) {
+        swap_ranks *= 2;
+    }
+
+    const int extra_ranks = num_ranks - swap_ranks;
+    if (extra_ranks > 0) {
+        CompositeRound fold;
+        fold.fold = true;
+        fold.merge_counts = std::vector<int>(extra_ranks, 2);
+        fold.merge_counts.resize(num_ranks - extra_ranks, 1);
+        schedule.push_back(fold);
+    }
+
+    for (int groups = swap_ranks; groups > 1; groups /= 2) {
+        CompositeRound round;
+        round.merge_counts = std::vector<int>(groups / 2, 2);
+        schedule.push_back(round);
+    }
+    return schedule;
+}
+
+std::vector<CompositeRound> radix_k_schedule(const int num_ranks,
+                                             const std::vector<int> &k_values)
+{
+    std::vector<int> ks;
+    int groups = num_ranks;
+    for (const int k : k_values) {
+        if (k < 2 || groups % k != 0) {
+            break;
+        }
+        ks.push_back(k);
+        groups /= k;
+    }
+    const std::vector<int> remaining = default_radix_k(groups);
+    ks.insert(ks.end(), remaining.begin(), remaining.end());
+
+    std::vector<CompositeRound> schedule;
+    groups = num_ranks;
+    for (const int k : ks) {
+        CompositeRound round;
+        round.merge_counts = std::vector<int>(groups / k, k);
+        schedule.push_back(round);
+        groups /= k;
+    }
+    return schedule;
+}
+
+std::vector<CompositeRound> two_three_swap_schedule(const int num_ranks)
+{
+    std::vector<CompositeRound> schedule;
+    for (int groups = num_ranks; groups > 1; groups /= 2) {
+        CompositeRound round;
+        round.merge_counts = std::vector<int>(groups / 2, 2);
+        if (groups % 2 != 0) {
+            round.merge_counts.back() = 3;
+        }
+        schedule.push_back(round);
+    }
+    return schedule;
+}
+
+std::vector<int> default_radix_k(int num_groups)
+{
+    std::vector<int> ks;
+    while (num_groups > 1) {
+        int k = 8;
+        while (k > 1 && num_groups % k != 0) {
+            --k;
+        }
+        if (k == 1) {
+            // No factor <= 8, so take the smallest factor of the remaining groups
+            k = 9;
+            while (num_groups % k != 0) {
+                ++k;
+            }
+        }
+        ks.push_back(k);
+        num_groups /= k;
+    }
+    return ks;
+}
+
+static bool range_empty(const vec2i &r)
+{
+    return r.y <= r.x;
+}
+
+static vec2i range_intersection(const vec2i &a, const vec2i &b)
+{
+    return vec2i(std::max(a.x, b.x), std::min(a.y, b.y));
+}
+
+/* Compute the ranges owned by the ranks in the merged group after the merge.
+ * If the ranks holding pieces of the image share identical ranges, as in
+ * radix-k, each shared range is split among the ranks sharing it so the new
+ * pieces are nested in the old ones. Otherwise the image is split evenly
+ * among the ranks, ordered by their current ranges to keep the overlap with
+ * the pixels they already have high
+ */
+static void partition_group(const vec2i &merged,
+                            const int img_size,
+                            const std::vector<vec2i> &ranges,
+                            std::vector<vec2i> &next_ranges)
+{
+    std::vector<int> active;
+    for (int p = merged.x; p < merged.y; ++p) {
+        if (!range_empty(ranges[p])) {
+            active.push_back(p);
+        }
+    }
+    std::stable_sort(active.begin(), active.end(), [&](const int a, const int b) {
+        return ranges[a].x < ranges[b].x;
+    });
+
+    // Find the runs of ranks sharing the same range and check they tile the image
+    std::vector<vec2i> runs;
+    bool nested = true;
+    for (size_t i = 0; i < active.size();) {
+        size_t j = i;
+        while (j < active.size() && ranges[active[j]] == ranges[active[i]]) {
+            ++j;
+        }
+        const int run_begin = runs.empty() ? 0 : ranges[active[runs.back().x]].y;
+        nested = nested && ranges[active[i]].x == run_begin;
+        runs.emplace_back(i, j);
+        i = j;
+    }
+    nested = nested && !runs.empty() && ranges[active[runs.back().x]].y == img_size;
+
+    if (nested) {
+        for (const auto &run : runs) {
+            const vec2i range = ranges[active[run.x]];
+            const int64_t len = range.y - range.x;
+            const int64_t k = run.y - run.x;
+            for (int j = 0; j < k; ++j) {
+                next_ranges[active[run.x + j]] =
+                    vec2i(range.x + len * j / k, range.x + len * (j + 1) / k);
+            }
+        }
+    } else {
+        const int64_t n = active.size();
+        for (int j = 0; j < n; ++j) {
+            next_ranges[active[j]] = vec2i(img_size * j / n, img_size * (j + 1) / n);
+        }
+    }
+}
+
+ScheduleCompositor::ScheduleCompositor(const std::vector<CompositeRound> &schedule,
+                                       MPI_Comm comm)
+    : schedule(schedule), comm(comm)
+{
+}
+
+template <typename Pixel>
+vec2i ScheduleCompositor::composite(const std::vector<int> &composite_order,
+                                    std::vector<Pixel> &img)
+{
+    using namespace std::chrono;
+
+    int rank = 0;
+    MPI_Comm_rank(comm, &rank);
+    const int num_ranks = composite_order.size();
+    const int img_size = img.size();
+    const int position =
+        std::distance(composite_order.begin(),
+                      std::find(composite_order.begin(), composite_order.end(), rank));
+
+    // The ranges of the image owned by each position in the composite order, and
+    // the [begin, end) spans of positions making up each group
+    std::vector<vec2i> ranges(num_ranks, vec2i(0, img_size));
+    std::vector<vec2i> groups;
+    for (int i = 0; i < num_ranks; ++i) {
+        groups.emplace_back(i, i + 1);
+    }
+
+    // The pieces exchanged in this frame, kept for the next one's temporal delta
+    const bool delta = options.temporal_delta && !options.lossy();
+    std::map<PieceKey, std::vector<uint32_t>> next_sent_pieces;
+    std::map<PieceKey, std::vector<uint32_t>> next_received_pieces;
+
+    round_times.clear();
+    exchange_stats = ExchangeStats();
+    for (size_t r = 0; r < schedule.size(); ++r) {
+        const auto start = high_resolution_clock::now();
+        const CompositeRound &round = schedule[r];
+
+        std::vector<vec2i> next_ranges = ranges;
+        std::vector<vec2i> next_groups;
+        // The groups being merged into the group containing this rank
+        std::vector<vec2i> subgroups;
+        size_t g = 0;
+        for (const int k : round.merge_counts) {
+            const vec2i merged(groups[g].x, groups[g + k - 1].y);
+            if (round.fold) {
+                for (int p = groups[g].y; p < merged.y; ++p) {
+                    next_ranges[p] = vec2i(0, 0);
+                }
+            } else {
+                partition_group(merged, img_size, ranges, next_ranges);
+            }
+
+            if (position >= merged.x && position < merged.y) {
+                subgroups = std::vector<vec2i>(groups.begin() + g, groups.begin() + g + k);
+            }
+            next_groups.push_back(merged);
+            g += k;
+        }
+        if (g != groups.size()) {
+            throw std::runtime_error("Compositing schedule round does not merge all groups");
+        }
+
+        const vec2i merged(subgroups.front().x, subgroups.back().y);
+        const vec2i owned = ranges[position];
+        const vec2i next_owned = next_ranges[position];
+
+        // Send the pieces of our current range that the other ranks now own, encoding
+        // them first if enabled
+        std::vector<MPI_Request> requests;
+        std::vector<size_t> send_offsets(merged.y - merged.x, 0);
+        size_t send_size = 0;
+        for (int p = merged.x; p < merged.y; ++p) {
+            const vec2i send = range_intersection(owned, next_ranges[p]);
+            send_offsets[p - merged.x] = send_size;
+            if (p == position || range_empty(send)) {
+                continue;
+            }
+            if (delta) {
+                send_size += max_delta_size<Pixel>(send.y - send.x, options);
+            } else if (options.encoded()) {
+                send_size += max_encoded_size<Pixel>(send.y - send.x, options);
+            }
+        }
+        if (send_buf.size() < send_size) {
+            send_buf.resize(send_size);
+        }
+        for (int p = merged.x; p < merged.y; ++p) {
+            const vec2i send = range_intersection(owned, next_ranges[p]);
+            if (p == position || range_empty(send)) {
+                continue;
+            }
+            const uint32_t *data = reinterpret_cast<const uint32_t *>(img.data() + send.x);
+            size_t count = (send.y - send.x) * pixel_words<Pixel>();
+            exchange_stats.raw_bytes += count * sizeof(uint32_t);
+            if (delta) {
+                // Send the changes from the last frame's piece if it was also exchanged
+                // with this rank, then keep the piece for the next frame
+                const PieceKey key = {int(r), composite_order[p], send.x, send.y};
+                const auto prev = sent_pieces.find(key);
+                uint32_t *encoded = send_buf.data() + send_offsets[p - merged.x];
+                std::vector<uint32_t> &kept = next_sent_pieces[key];
+                if (prev != sent_pieces.end()) {
+                    size_t unchanged = 0;
+                    count = encode_delta(img.data() + send.x,
+                                         reinterpret_cast<const Pixel *>(prev->second.data()),
+                                         send.y - send.x,
+                                         options,
+                                         encoded,
+                                         unchanged);
+                    exchange_stats.delta_avoided_bytes += unchanged * sizeof(Pixel);
+                    kept = std::move(prev->second);
+                } else {
+                    count =
+                        encode_pixels(img.data() + send.x, send.y - send.x, options, encoded);
+                }
+                kept.assign(data, data + (send.y - send.x) * pixel_words<Pixel>());
+                data = encoded;
+            } else if (options.encoded()) {
+                uint32_t *encoded = send_buf.data() + send_offsets[p - merged.x];
+                count = encode_pixels(img.data() + send.x, send.y - send.x, options, encoded);
+                data = encoded;
+            }
+            exchange_stats.sent_bytes += count * sizeof(uint32_t);
+
+            requests.push_back(MPI_REQUEST_NULL);
+            MPI_Isend(
+                data, count, MPI_UINT32_T, composite_order[p], r, comm, &requests.back());
+        }
+
+        // Receive the pieces of our new range from the ranks which currently own them
+        std::vector<size_t> recv_offsets(merged.y - merged.x, 0);
+        size_t recv_size = 0;
+        for (int p = merged.x; p < merged.y; ++p) {
+            const vec2i recv = range_intersection(ranges[p], next_owned);
+            recv_offsets[p - merged.x] = recv_size;
+            if (p != position && !range_empty(recv)) {
+                recv_size += delta ? max_delta_size<Pixel>(recv.y - recv.x, options)
+                                   : max_encoded_size<Pixel>(recv.y - recv.x, options);
+            }
+        }
+        if (recv_buf.size() < recv_size) {
+            recv_buf.resize(recv_size);
+        }
+        for (int p = merged.x; p < merged.y; ++p) {
+            const vec2i recv = range_intersection(ranges[p], next_owned);
+            if (p == position || range_empty(recv)) {
+                continue;
+            }
+            const size_t count = delta ? max_delta_size<Pixel>(recv.y - recv.x, options)
+                                       : max_encoded_size<Pixel>(recv.y - recv.x, options);
+            requests.push_back(MPI_REQUEST_NULL);
+            MPI_Irecv(recv_buf.data() + recv_offsets[p - merged.x],
+                      count,
+                      MPI_UINT32_T,
+                      composite_order[p],
+                      r,
+                      comm,
+                      &requests.back());
+        }
+        MPI_Waitall(requests.size(), requests.data(), MPI_STATUSES_IGNORE);
+
+        // With temporal delta encoding the received pieces are applied to the pieces
+        // kept from the last frame, or decoded if there isn't one, and blended raw
+        std::vector<const Pixel *> received_pixels(merged.y - merged.x, nullptr);
+        for (int p = merged.x; delta && p < merged.y; ++p) {
+            const vec2i recv = range_intersection(ranges[p], next_owned);
+            if (p == position || range_empty(recv)) {
+                continue;
+            }
+            const PieceKey key = {int(r), composite_order[p], recv.x, recv.y};
+            const auto prev = received_pieces.find(key);
+            const uint32_t *src = recv_buf.data() + recv_offsets[p - merged.x];
+            std::vector<uint32_t> &kept = next_received_pieces[key];
+            Pixel *pixels = nullptr;
+            if (prev != received_pieces.end()) {
+                kept = std::move(prev->second);
+                pixels = reinterpret_cast<Pixel *>(kept.data());
+                decode_delta(src, recv.y - recv.x, options, pixels);
+            } else {
+                kept.resize((recv.y - recv.x) * pixel_words<Pixel>());
+                pixels = reinterpret_cast<Pixel *>(kept.data());
+                decode_pixels(src, recv.y - recv.x, options, pixels);
+            }
+            received_pixels[p - merged.x] = pixels;
+        }
+
+        // Each group's pieces tile the image, so the front group's pieces are copied
+        // in and the groups behind it are blended under them in order
+        if (!range_empty(next_owned)) {
+            const int next_len = next_owned.y - next_owned.x;
+            if (composited.size() < next_len * pixel_words<Pixel>()) {
+                composited.resize(next_len * pixel_words<Pixel>());
+            }
+            Pixel *composited_pixels = reinterpret_cast<Pixel *>(composited.data());
+            for (size_t s = 0; s < subgroups.size(); ++s) {
+                for (int p = subgroups[s].x; p < subgroups[s].y; ++p) {
+                    const vec2i piece = range_intersection(ranges[p], next_owned);
+                    if (range_empty(piece)) {
+                        continue;
+                    }
+                    const size_t count = piece.y - piece.x;
+                    Pixel *dst = composited_pixels + piece.x - next_owned.x;
+                    if (p == position || delta || !options.encoded()) {
+                        const Pixel *src = img.data() + piece.x;
+                        if (delta && p != position) {
+                            src = received_pixels[p - merged.x];
+                        } else if (p != position) {
+                            src = reinterpret_cast<const Pixel *>(recv_buf.data() +
+                                                                  recv_offsets[p - merged.x]);
+                        }
+                        if (s == 0) {
+                            std::memcpy(dst, src, count * sizeof(Pixel));
+                        } else {
+                            blend_images(dst, src, dst, count);
+                        }
+                    } else {
+                        const uint32_t *src = recv_buf.data() + recv_offsets[p - merged.x];
+                        if (s == 0) {
+                            decode_pixels(src, count, options, dst);
+                        } else {
+                            blend_encoded_under(dst, src, count, options);
+                        }
+                    }
+                }
+            }
+            std::memcpy(
+                img.data() + next_owned.x, composited_pixels, next_len * sizeof(Pixel));
+        }
+
+        ranges = next_ranges;
+        groups = next_groups;
+
+        const auto end = high_resolution_clock::now();
+        round_times.push_back(
+            duration_cast<duration<double, std::milli>>(end - start).count());
+    }
+    if (delta) {
+        sent_pieces = std::move(next_sent_pieces);
+        received_pieces = std::move(next_received_pieces);
+    }
+    return ranges[position];
+}
+
+void ScheduleCompositor::reset_temporal_delta()
+{
+    sent_pieces.clear();
+    received_pieces.clear();
+}
+
+NodeCompositor::NodeCompositor(MPI_Comm comm)
+{
+    int rank = 0;
+    int size = 0;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &size);
+    MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, rank, MPI_INFO_NULL, &node_comm);
+    MPI_Comm_rank(node_comm, &node_rank);
+    MPI_Comm_size(node_comm, &node_size);
+
+    MPI_Comm_split(comm, node_rank == 0 ? 0 : MPI_UNDEFINED, rank, &leader_comm);
+    int node = 0;
+    if (is_leader()) {
+        MPI_Comm_rank(leader_comm, &node);
+        MPI_Comm_size(leader_comm, &num_nodes);
+    }
+    MPI_Bcast(&node, 1, MPI_INT, 0, node_comm);
+    MPI_Bcast(&num_nodes, 1, MPI_INT, 0, node_comm);
+
+    rank_nodes.resize(size, 0);
+    MPI_Allgather(&node, 1, MPI_INT, rank_nodes.data(), 1, MPI_INT, comm);
+    for (int r = 0; r < size; ++r) {
+        if (rank_nodes[r] == node) {
+            node_members.push_back(r);
+        }
+    }
+}
+
+NodeCompositor::~NodeCompositor()
+{
+    free_window();
+    if (leader_comm != MPI_COMM_NULL) {
+        MPI_Comm_free(&leader_comm);
+    }
+    MPI_Comm_free(&node_comm);
+}
+
+bool NodeCompositor::is_leader() const
+{
+    return node_rank == 0;
+}
+
+bool NodeCompositor::nodes_contiguous(const std::vector<int> &composite_order) const
+{
+    std::vector<bool> finished(num_nodes, false);
+    for (size_t i = 0; i < composite_order.size(); ++i) {
+        const int node = rank_nodes[composite_order[i]];
+        if (finished[node]) {
+            return false;
+        }
+        if (i + 1 < composite_order.size() && rank_nodes[composite_order[i + 1]] != node) {
+            finished[node] = true;
+        }
+    }
+    return true;
+}
+
+std::vector<int> NodeCompositor::node_order(const std::vector<int> &composite_order) const
+{
+    std::vector<int> order;
+    for (const int r : composite_order) {
+        if (order.empty() || order.back() != rank_nodes[r]) {
+            order.push_back(rank_nodes[r]);
+        }
+    }
+    return order;
+}
+
+template <typename Pixel>
+void NodeCompositor::composite(const std::vector<int> &composite_order,
+                               std::vector<Pixel> &img)
+{
+    using namespace std::chrono;
+    const auto start = high_resolution_clock::now();
+    if (node_size == 1) {
+        blend_time = 0.0;
+        return;
+    }
+
+    const size_t n = img.size();
+    if (window_bytes < n * sizeof(Pixel)) {
+        free_window();
+        void *base = nullptr;
+        MPI_Win_allocate_shared(
+            n * sizeof(Pixel), 1, MPI_INFO_NULL, node_comm, &base, &window);
+        MPI_Win_lock_all(MPI_MODE_NOCHECK, window);
+        window_bytes = n * sizeof(Pixel);
+    }
+    std::memcpy(static_cast<void *>(node_image(node_rank)), img.data(), n * sizeof(Pixel));
+    sync_window();
+
+    // The node's images in front-to-back order, the node ranks are in the same order
+    // as the ranks in the parent communicator
+    std::vector<const Pixel *> images;
+    for (const int r : composite_order) {
+        const auto it = std::find(node_members.begin(), node_members.end(), r);
+        if (it != node_members.end()) {
+            const int member = std::distance(node_members.begin(), it);
+            images.push_back(static_cast<const Pixel *>(node_image(member)));
+        }
+    }
+
+    // Each rank blends its stripe of the images and writes it into the leader's image.
+    // Only this rank touches the stripe in any of the images, so it can be written
+    // without waiting for the others
+    const size_t begin = n * node_rank / node_size;
+    const size_t count = n * (node_rank + 1) / node_size - begin;
+    if (stripe.size() < count * pixel_words<Pixel>()) {
+        stripe.resize(count * pixel_words<Pixel>());
+    }
+    Pixel *blended = reinterpret_cast<Pixel *>(stripe.data());
+    std::copy(images[0] + begin, images[0] + begin + count, blended);
+    for (size_t i = 1; i < images.size(); ++i) {
+        blend_images(blended, images[i] + begin, blended, count);
+    }
+    std::copy(blended, blended + count, static_cast<Pixel *>(node_image(0)) + begin);
+    sync_window();
+
+    if (is_leader()) {
+        const Pixel *result = static_cast<const Pixel *>(node_image(0));
+        std::copy(result, result + n, img.begin());
+    }
+    blend_time =
+        duration_cast<duration<double, std::milli>>(high_resolution_clock::now() - start)
+            .count();
+}
+
+void *NodeCompositor::node_image(const int rank) const
+{
+    MPI_Aint size = 0;
+    int disp_unit = 0;
+    void *base = nullptr;
+    MPI_Win_shared_query(window, rank, &size, &disp_unit, &base);
+    return base;
+}
+
+void NodeCompositor::sync_window() const
+{
+    MPI_Win_sync(window);
+    MPI_Barrier(node_comm);
+    MPI_Win_sync(window);
+}
+
+void NodeCompositor::free_window()
+{
+    if (window != MPI_WIN_NULL) {
+        MPI_Win_unlock_all(window);
+        MPI_Win_free(&window);
+        window_bytes = 0;
+    }
+}
+
+// The pixel types of each PixelFormat
+#define INSTANTIATE_PIXEL_FUNCTIONS(Pixel)                                                    \
+    template size_t max_rle_size<Pixel>(const size_t);                                        \
+    template size_t encode_active_pixels(const Pixel *, const size_t, uint32_t *);            \
+    template void decode_active_pixels(const uint32_t *, const size_t, Pixel *);              \
+    template void blend_active_pixels_under(Pixel *, const uint32_t *, const size_t);         \
+    template size_t max_quantized_size<Pixel>(const size_t);                                  \
+    template size_t quantize_pixels(const Pixel *, const size_t, const vec4f &, uint32_t *);  \
+    template void dequantize_pixels(const uint32_t *, const size_t, const vec4f &, Pixel *);  \
+    template void blend_quantized_under(                                                      \
+        Pixel *, const uint32_t *, const size_t, const vec4f &);                              \
+    template size_t max_encoded_size<Pixel>(const size_t, const CompositeOptions &);          \
+    template size_t encode_pixels(                                                            \
+        const Pixel *, const size_t, const CompositeOptions &, uint32_t *);                   \
+    template void decode_pixels(                                                              \
+        const uint32_t *, const size_t, const CompositeOptions &, Pixel *);                   \
+    template void blend_encoded_under(                                                        \
+        Pixel *, const uint32_t *, const size_t, const CompositeOptions &);                   \
+    template size_t max_delta_size<Pixel>(const size_t, const CompositeOptions &);            \
+    template size_t encode_delta(const Pixel *,                                               \
+                                 const Pixel *,                                               \
+                                 const size_t,                                                \
+                                 const CompositeOptions &,                                    \
+                                 uint32_t *,                                                  \
+                                 size_t &);                                                   \
+    template void decode_delta(                                                               \
+        const uint32_t *, const size_t, const CompositeOptions &, Pixel *);                   \
+    template vec2i ScheduleCompositor::composite(const std::vector<int> &,                    \
+                                                 std::vector<Pixel> &);                       \
+    template void NodeCompositor::composite(const std::vector<int> &, std::vector<Pixel> &);
+
+INSTANTIATE_PIXEL_FUNCTIONS(uint32_t)
+INSTANTIATE_PIXEL_FUNCTIONS(RGBA16F)
+INSTANTIATE_PIXEL_FUNCTIONS(vec4f)
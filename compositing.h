@@ -0,0 +1,307 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <map>
+#include <vector>
+#include <mpi.h>
+#include <rkcommon/math/vec.h>
+#include "pixel_format.h"
+
+using namespace rkcommon::math;
+
+// Options for how the native compositors exchange partial images
+struct CompositeOptions {
+    // Run-length encode the active pixels of the partial images before sending them
+    bool rle = true;
+    // The max absolute error per RGBA channel, in [0, 1] units, allowed when lossy
+    // compressing the partial images. Lossy compression is used instead of the
+    // run-length encoding when any channel's bound is non-zero, and the channels with a
+    // zero bound are kept lossless
+    vec4f error_bound = vec4f(0.f);
+    // The pixel format the partial images are exchanged and blended in
+    PixelFormat format = PixelFormat::RGBA8;
+    // Also composite each frame in RGBA32F and report the error of the final image
+    // against it
+    bool report_precision_error = false;
+    // Blend the images of the ranks sharing a node in shared memory before running the
+    // schedule compositors across the nodes
+    bool node_local = false;
+    // Only send the tiles of each piece of the partial images which changed since the
+    // same piece was exchanged in the last frame. Only supported by the schedule
+    // compositors with lossless compression
+    bool temporal_delta = false;
+
+    bool lossy() const;
+
+    // Whether the partial images are encoded before being sent, or sent as raw pixels
+    bool encoded() const;
+};
+
+// The bytes of partial image data sent by a rank during compositing
+struct ExchangeStats {
+    // The size the data would be without any encoding
+    size_t raw_bytes = 0;
+    // The size of the data actually sent
+    size_t sent_bytes = 0;
+    // The raw size of the tiles which were unchanged since the last frame, and not
+    // sent with temporal delta encoding
+    size_t delta_avoided_bytes = 0;
+};
+
+/* The encodings split the pixels into independent chunks of ENCODE_CHUNK_PIXELS so
+ * they can be encoded and blended in parallel. Each chunk stores its encoded size
+ * in words followed by the encoded pixels.
+ */
+const size_t ENCODE_CHUNK_PIXELS = 16384;
+
+/* Active pixel run-length encoding. Each chunk is made of runs of empty (fully
+ * zero) and active pixels, each run being a word with the empty count in the low
+ * 16 bits and the active count in the high 16 bits followed by the active pixels'
+ * words.
+ */
+template <typename Pixel>
+size_t max_rle_size(const size_t n);
+
+// Encode the pixels into out, which must have max_rle_size(n) words. Returns the
+// number of words used by the encoding
+template <typename Pixel>
+size_t encode_active_pixels(const Pixel *pixels, const size_t n, uint32_t *out);
+
+template <typename Pixel>
+void decode_active_pixels(const uint32_t *encoded, const size_t n, Pixel *out);
+
+// Blend the n encoded pixels under the pixels in front, skipping the empty runs
+template <typename Pixel>
+void blend_active_pixels_under(Pixel *front, const uint32_t *encoded, const size_t n);
+
+/* Lossy block quantization. Each chunk is split into blocks of QUANTIZE_BLOCK_PIXELS,
+ * and each channel of a block is stored as its min value and the offsets from it
+ * quantized to steps of twice the channel's error bound, bit-packed with as many
+ * bits as the block's range of the channel needs. Channels with a zero error bound are
+ * stored as their raw 32 bit floats instead. Fully empty blocks are stored as just
+ * their header word. The error bound applies to each exchange, so a pixel
+ * blended over multiple rounds may accumulate error from each of them.
+ */
+const size_t QUANTIZE_BLOCK_PIXELS = 64;
+
+template <typename Pixel>
+size_t max_quantized_size(const size_t n);
+
+template <typename Pixel>
+size_t quantize_pixels(const Pixel *pixels,
+                       const size_t n,
+                       const vec4f &error_bound,
+                       uint32_t *out);
+
+template <typename Pixel>
+void dequantize_pixels(const uint32_t *encoded,
+                       const size_t n,
+                       const vec4f &error_bound,
+                       Pixel *out);
+
+// Blend the n quantized pixels under the pixels in front, skipping the empty blocks
+template <typename Pixel>
+void blend_quantized_under(Pixel *front,
+                           const uint32_t *encoded,
+                           const size_t n,
+                           const vec4f &error_bound);
+
+/* Temporal delta encoding. The pixels are split into tiles of DELTA_TILE_PIXELS and
+ * compared against the previous pixels, and stored as a bit mask of the changed tiles
+ * followed by the changed tiles' pixels encoded with the lossless encoding selected by
+ * the options.
+ */
+const size_t DELTA_TILE_PIXELS = 64;
+
+template <typename Pixel>
+size_t max_delta_size(const size_t n, const CompositeOptions &options);
+
+// Encode the pixels' changes from prev into out, which must have max_delta_size(n)
+// words. Returns the number of words used, and the number of unchanged pixels
+template <typename Pixel>
+size_t encode_delta(const Pixel *pixels,
+                    const Pixel *prev,
+                    const size_t n,
+                    const CompositeOptions &options,
+                    uint32_t *out,
+                    size_t &unchanged);
+
+// Apply the encoded changes to the previous pixels
+template <typename Pixel>
+void decode_delta(const uint32_t *encoded,
+                  const size_t n,
+                  const CompositeOptions &options,
+                  Pixel *pixels);
+
+/* Encode the pixels with the encoding selected by the options. out must have
+ * max_encoded_size(n, options) words, returns the number of words used
+ */
+template <typename Pixel>
+size_t max_encoded_size(const size_t n, const CompositeOptions &options);
+
+template <typename Pixel>
+size_t encode_pixels(const Pixel *pixels,
+                     const size_t n,
+                     const CompositeOptions &options,
+                     uint32_t *out);
+
+template <typename Pixel>
+void decode_pixels(const uint32_t *encoded,
+                   const size_t n,
+                   const CompositeOptions &options,
+                   Pixel *out);
+
+// Blend the n encoded pixels under the pixels in front
+template <typename Pixel>
+void blend_encoded_under(Pixel *front,
+                         const uint32_t *encoded,
+                         const size_t n,
+                         const CompositeOptions &options);
+
+/* A round of a compositing schedule. Consecutive groups of ranks in the composite
+ * order from the previous round are merged into new groups, with merge_counts[i]
+ * of the previous groups forming the i'th new group. Initially each rank is its
+ * own group.
+ */
+struct CompositeRound {
+    std::vector<int> merge_counts;
+    // If folding, the ranks in the front group being merged keep their pieces of the
+    // image and the other groups send them their pixels and drop out
+    bool fold = false;
+
+    // The largest number of groups merged in this round
+    int max_k() const;
+};
+
+/* Binary swap, folding the extra ranks into their neighbors in the composite
+ * order first when the number of ranks is not a power of two
+ */
+std::vector<CompositeRound> binary_swap_schedule(const int num_ranks);
+
+/* Radix-k, where each round merges groups of k_values[i]. Rounds are taken from
+ * k_values while they evenly divide the number of groups remaining, any remaining
+ * groups are merged with the default k-values for that count, so the schedule is
+ * valid for any number of ranks.
+ */
+std::vector<CompositeRound> radix_k_schedule(const int num_ranks,
+                                             const std::vector<int> &k_values);
+
+/* 2-3 swap, where each round merges groups of 2, with one group of 3 when the
+ * number of groups is odd. The merged groups split the image evenly among their
+ * ranks, so every rank ends up with the same share of the image for any number
+ * of ranks without folding any ranks out.
+ */
+std::vector<CompositeRound> two_three_swap_schedule(const int num_ranks);
+
+/* Factor the number of groups into k-values which are as close to 8 as possible,
+ * falling back to the number itself for primes > 8
+ */
+std::vector<int> default_radix_k(int num_groups);
+
+/* Runs a compositing schedule over the ranks of a communicator. Each merge splits
+ * the image among the ranks in the new group, and each rank receives the pieces
+ * of its new range from the ranks in the merged groups and blends them in the
+ * composite order.
+ */
+struct ScheduleCompositor {
+    std::vector<CompositeRound> schedule;
+    MPI_Comm comm = MPI_COMM_WORLD;
+    CompositeOptions options;
+
+    // The time taken by each round of the last frame, in milliseconds
+    std::vector<double> round_times;
+    // The data sent in the last frame
+    ExchangeStats exchange_stats;
+
+    ScheduleCompositor() = default;
+
+    ScheduleCompositor(const std::vector<CompositeRound> &schedule,
+                       MPI_Comm comm = MPI_COMM_WORLD);
+
+    /* Composite the image with the other ranks' images, with the front-to-back order
+     * of the ranks given by the composite order. Returns the [begin, end) range of the
+     * final image owned by this rank, which is stored in the same range of img.
+     * Instantiated for the pixel types of each PixelFormat
+     */
+    template <typename Pixel>
+    vec2i composite(const std::vector<int> &composite_order, std::vector<Pixel> &img);
+
+    /* Drop the pieces kept for temporal delta encoding, which must be done on all ranks
+     * of the communicator when the ranks in it change
+     */
+    void reset_temporal_delta();
+
+private:
+    std::vector<uint32_t> send_buf;
+    std::vector<uint32_t> recv_buf;
+    std::vector<uint32_t> composited;
+
+    /* The raw pixels of the pieces sent and received in the last frame for temporal
+     * delta encoding, keyed by the round, the other rank and the piece's range. The
+     * sender and receiver of a piece both keep it, so they agree on whether it's sent
+     * as a delta
+     */
+    using PieceKey = std::array<int, 4>;
+    std::map<PieceKey, std::vector<uint32_t>> sent_pieces;
+    std::map<PieceKey, std::vector<uint32_t>> received_pieces;
+};
+
+/* Blends the partial images of the ranks sharing a node in a shared memory window,
+ * so only the node's leader takes part in compositing across the nodes. The ranks
+ * of a node can only be blended first if they're contiguous in the composite order.
+ */
+struct NodeCompositor {
+    // The ranks on this node, and the communicator of the node leaders which is
+    // MPI_COMM_NULL on the other ranks
+    MPI_Comm node_comm = MPI_COMM_NULL;
+    MPI_Comm leader_comm = MPI_COMM_NULL;
+    int node_rank = 0;
+    int node_size = 1;
+    int num_nodes = 1;
+    // The node index of each rank, nodes are numbered by their rank in leader_comm
+    std::vector<int> rank_nodes;
+    // The ranks on this node, indexed by their node rank
+    std::vector<int> node_members;
+
+    // The time taken by the node-local blend in the last frame, in milliseconds
+    double blend_time = 0.0;
+
+    NodeCompositor(MPI_Comm comm = MPI_COMM_WORLD);
+
+    ~NodeCompositor();
+
+    NodeCompositor(const NodeCompositor &) = delete;
+    NodeCompositor &operator=(const NodeCompositor &) = delete;
+
+    bool is_leader() const;
+
+    // Check if the ranks of each node are contiguous in the composite order
+    bool nodes_contiguous(const std::vector<int> &composite_order) const;
+
+    // The front-to-back order of the nodes, given contiguous nodes
+    std::vector<int> node_order(const std::vector<int> &composite_order) const;
+
+    /* Blend the images of the node's ranks in the composite order, with the result
+     * written to img on the node leader. Each rank blends a stripe of the image
+     * reading the others' images directly from the shared window
+     */
+    template <typename Pixel>
+    void composite(const std::vector<int> &composite_order, std::vector<Pixel> &img);
+
+private:
+    MPI_Win window = MPI_WIN_NULL;
+    size_t window_bytes = 0;
+    // The local stripe being blended
+    std::vector<uint32_t> stripe;
+
+    // The shared image of the rank on this node
+    void *node_image(const int rank) const;
+
+    // Make the writes to the window visible to the rest of the node
+    void sync_window() const;
+
+    void free_window();
+};
+
@@ -1,7 +1,14 @@
 #include "loader.h"
+#include <algorithm>
+#include <array>
 #include <chrono>
+#include <cmath>
 #include <cstdio>
+#include <fstream>
 #include <iostream>
+#include <map>
+#include <numeric>
+#include <sstream>
 #include <mpi.h>
 #include <ospray/ospray.h>
 #include <ospray/ospray_cpp.h>
@@ -53,42 +60,286 @@ vec3i compute_grid(int num)
     }
     return grid;
 }
-std::array<int, 3> compute_ghost_faces(const vec3i &brick_id, const vec3i &grid)
+KdTree::KdTree(const vec3i &volume_dims, const int num_ranks, const int bricks_per_rank)
+    : bricks_per_rank(bricks_per_rank)
+{
+    build(box3i(vec3i(0), volume_dims), num_ranks * bricks_per_rank);
+}
+
+KdTree::KdTree(const KdTree &prev, const std::vector<double> &brick_costs)
+    : bricks_per_rank(prev.bricks_per_rank)
+{
+    build(prev.nodes[0].bounds, prev.bricks.size(), &prev, &brick_costs);
+}
+
+std::vector<int> KdTree::front_to_back(const vec3f &pos) const
+{
+    std::vector<int> order;
+    order.reserve(bricks.size());
+    std::vector<int> stack = {0};
+    while (!stack.empty()) {
+        const int id = stack.back();
+        stack.pop_back();
+        const Node &node = nodes[id];
+        if (node.brick != -1) {
+            order.push_back(node.brick);
+            continue;
+        }
+        // The child on the same side of the split plane as the position is in front
+        if (pos[node.axis] < node.split) {
+            stack.push_back(node.upper);
+            stack.push_back(id + 1);
+        } else {
+            stack.push_back(id + 1);
+            stack.push_back(node.upper);
+        }
+    }
+    return order;
+}
+
+// The cost of the box, from the cost of the bricks of the tree overlapping it
+static double box_cost(const box3i &box,
+                       const KdTree &tree,
+                       const std::vector<double> &brick_costs)
+{
+    double cost = 0.0;
+    for (size_t i = 0; i < tree.bricks.size(); ++i) {
+        const box3i overlap = intersectionOf(box, tree.bricks[i]);
+        if (!overlap.empty()) {
+            cost += brick_costs[i] * double(overlap.size().long_product()) /
+                    tree.bricks[i].size().long_product();
+        }
+    }
+    return cost;
+}
+
+int KdTree::build(const box3i &bounds,
+                  const int num_bricks,
+                  const KdTree *prev,
+                  const std::vector<double> *brick_costs)
+{
+    const int id = nodes.size();
+    nodes.push_back(Node());
+    nodes[id].bounds = bounds;
+    if (num_bricks == 1) {
+        nodes[id].brick = bricks.size();
+        bricks.push_back(bounds);
+        return id;
+    }
+
+    const vec3i size = bounds.size();
+    int axis = 0;
+    for (int i = 1; i < 3; ++i) {
+        if (size[i] > size[axis]) {
+            axis = i;
+        }
+    }
+    // Above the ranks' subtrees the ranks are split in half, along with their bricks
+    const int lower_bricks = num_bricks > bricks_per_rank
+                                 ? num_bricks / bricks_per_rank / 2 * bricks_per_rank
+                                 : num_bricks / 2;
+    int split = bounds.lower[axis] + int(int64_t(size[axis]) * lower_bricks / num_bricks);
+    if (prev && num_bricks > bricks_per_rank && size[axis] > 1) {
+        // Find the first split giving the lower child its share of the cost, keeping
+        // each child at least a quarter of its even share of the box so the rank's
+        // bricks can't become degenerate
+        const int min_lower = std::max(1, (split - bounds.lower[axis]) / 4);
+        const int min_upper = std::max(1, (bounds.upper[axis] - split) / 4);
+        const double target =
+            box_cost(bounds, *prev, *brick_costs) * lower_bricks / num_bricks;
+        int lo = bounds.lower[axis] + min_lower;
+        int hi = bounds.upper[axis] - min_upper;
+        while (lo < hi) {
+            const int mid = lo + (hi - lo) / 2;
+            box3i lower = bounds;
+            lower.upper[axis] = mid;
+            if (box_cost(lower, *prev, *brick_costs) < target) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        split = lo;
+    }
+
+    box3i lower = bounds;
+    lower.upper[axis] = split;
+    box3i upper = bounds;
+    upper.lower[axis] = split;
+
+    nodes[id].axis = axis;
+    nodes[id].split = split;
+    build(lower, lower_bricks, prev, brick_costs);
+    const int upper_id = build(upper, num_bricks - lower_bricks, prev, brick_costs);
+    nodes[id].upper = upper_id;
+    return id;
+}
+
+// Read the group of each hostname from the topology hint file
+static std::map<std::string, std::string> load_topology_hints(const std::string &file)
+{
+    std::map<std::string, std::string> groups;
+    std::ifstream fin(file.c_str());
+    if (!fin) {
+        throw std::runtime_error("Failed to open topology file " + file);
+    }
+    std::string line;
+    while (std::getline(fin, line)) {
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        std::istringstream iss(line);
+        std::string host, group;
+        if (iss >> host >> group) {
+            groups[host] = group;
+        }
+    }
+    return groups;
+}
+
+BrickPlacement compute_brick_placement(const int num_ranks, const int bricks_per_rank)
+{
+    BrickPlacement placement;
+    if (num_ranks == 1) {
+        placement.rank_bricks.emplace_back(bricks_per_rank, 0);
+        std::iota(placement.rank_bricks[0].begin(), placement.rank_bricks[0].end(), 0);
+        placement.brick_owners.resize(bricks_per_rank, 0);
+        return placement;
+    }
+
+    int mpi_size = 0;
+    MPI_Comm_size(MPI_COMM_WORLD, &mpi_size);
+    if (mpi_size != num_ranks) {
+        throw std::runtime_error("Brick placement requires the bricks on every rank");
+    }
+
+    std::vector<char> hostnames(size_t(mpi_size) * MPI_MAX_PROCESSOR_NAME, '\0');
+    {
+        char hostname[MPI_MAX_PROCESSOR_NAME] = {0};
+        int len = 0;
+        MPI_Get_processor_name(hostname, &len);
+        MPI_Allgather(hostname,
+                      MPI_MAX_PROCESSOR_NAME,
+                      MPI_CHAR,
+                      hostnames.data(),
+                      MPI_MAX_PROCESSOR_NAME,
+                      MPI_CHAR,
+                      MPI_COMM_WORLD);
+    }
+
+    const std::string topology_file = get_env("OSP_TOPOLOGY_FILE");
+    std::map<std::string, std::string> host_groups;
+    if (!topology_file.empty()) {
+        host_groups = load_topology_hints(topology_file);
+    }
+
+    // Groups and nodes are ordered by their lowest rank, and the ranks of a node keep
+    // their order, so every rank computes the same placement
+    std::map<std::string, int> group_first_rank;
+    std::map<std::string, int> node_first_rank;
+    std::vector<std::string> rank_hosts(mpi_size);
+    std::vector<std::string> rank_groups(mpi_size);
+    for (int i = 0; i < mpi_size; ++i) {
+        rank_hosts[i] = std::string(&hostnames[size_t(i) * MPI_MAX_PROCESSOR_NAME]);
+        auto group = host_groups.find(rank_hosts[i]);
+        rank_groups[i] = group != host_groups.end() ? group->second : "";
+        group_first_rank.emplace(rank_groups[i], i);
+        node_first_rank.emplace(rank_hosts[i], i);
+    }
+    std::vector<int> ranks(mpi_size, 0);
+    std::iota(ranks.begin(), ranks.end(), 0);
+    std::stable_sort(ranks.begin(), ranks.end(), [&](const int a, const int b) {
+        const int group_a = group_first_rank[rank_groups[a]];
+        const int group_b = group_first_rank[rank_groups[b]];
+        if (group_a != group_b) {
+            return group_a < group_b;
+        }
+        return node_first_rank[rank_hosts[a]] < node_first_rank[rank_hosts[b]];
+    });
+
+    // Each rank's subtree of bricks is a contiguous range of the tree's leaves
+    placement.rank_bricks.resize(mpi_size);
+    placement.brick_owners.resize(size_t(mpi_size) * bricks_per_rank, 0);
+    for (int i = 0; i < mpi_size; ++i) {
+        for (int j = i * bricks_per_rank; j < (i + 1) * bricks_per_rank; ++j) {
+            placement.rank_bricks[ranks[i]].push_back(j);
+            placement.brick_owners[j] = ranks[i];
+        }
+    }
+    return placement;
+}
+
+std::array<int, 3> compute_ghost_faces(const box3i &brick, const vec3i &volume_dims)
 {
     std::array<int, 3> faces = {NEITHER_FACE, NEITHER_FACE, NEITHER_FACE};
     for (size_t i = 0; i < 3; ++i) {
-        if (brick_id[i] < grid[i] - 1) {
+        if (brick.upper[i] < volume_dims[i]) {
             faces[i] |= POS_FACE;
         }
-        if (brick_id[i] > 0) {
+        if (brick.lower[i] > 0) {
             faces[i] |= NEG_FACE;
         }
     }
     return faces;
 }
 
-VolumeBrick load_volume_brick(json &config, const int mpi_rank, const int mpi_size)
+/* Create the brick's volume from its voxel data and compute the brick's value range
+ * from the voxels
+ */
+static void commit_brick_volume(VolumeBrick &brick, const json &config)
 {
-    using namespace std::chrono;
-    VolumeBrick brick;
+    const vec3f spacing = get_vec<int, 3>(config["spacing"]);
+    const std::string voxel_type_string = config["type"].get<std::string>();
+    const size_t n_voxels = brick.full_dims.long_product();
 
-    const std::string volume_file = config["volume"].get<std::string>();
-    const vec3i grid = compute_grid(mpi_size);
-    if (volume_file == "generated") {
-        const vec3i brick_dims = get_vec<int, 3>(config["brick_size"]);
-        const vec3i volume_dims = brick_dims * grid;
-        config["size"] = {volume_dims.x, volume_dims.y, volume_dims.z};
+    brick.brick = cpp::Volume("structuredRegular");
+    brick.brick.setParam("dimensions", brick.full_dims);
+    brick.brick.setParam("gridSpacing", spacing);
+
+    cpp::SharedData osp_data;
+    if (voxel_type_string == "uint8") {
+        osp_data = cpp::SharedData(brick.voxel_data->data(), vec3ul(brick.full_dims));
+        brick.value_range = compute_value_range(brick.voxel_data->data(), n_voxels);
+    } else if (voxel_type_string == "uint16") {
+        const uint16_t *voxels = reinterpret_cast<uint16_t *>(brick.voxel_data->data());
+        osp_data = cpp::SharedData(voxels, vec3ul(brick.full_dims));
+        brick.value_range = compute_value_range(voxels, n_voxels);
+    } else if (voxel_type_string == "float32") {
+        const float *voxels = reinterpret_cast<float *>(brick.voxel_data->data());
+        osp_data = cpp::SharedData(voxels, vec3ul(brick.full_dims));
+        brick.value_range = compute_value_range(voxels, n_voxels);
+    } else if (voxel_type_string == "float64") {
+        const double *voxels = reinterpret_cast<double *>(brick.voxel_data->data());
+        osp_data = cpp::SharedData(voxels, vec3ul(brick.full_dims));
+        brick.value_range = compute_value_range(voxels, n_voxels);
+    } else {
+        std::cerr << "[error]: Unsupported voxel type\n";
+        throw std::runtime_error("[error]: Unsupported voxel type");
     }
+    brick.brick.setParam("data", osp_data);
+
+    // Set the clipping box of the volume to clip off the ghost voxels
+    brick.brick.setParam("volumeClippingBoxLower", brick.bounds.lower);
+    brick.brick.setParam("volumeClippingBoxUpper", brick.bounds.upper);
+    brick.brick.commit();
+}
+
+/* Load the brick's voxels from the volume file with MPI I/O, or fill them with the
+ * rank for the generated volume. Collective when reading from the file
+ */
+static VolumeBrick load_brick(const json &config,
+                              const box3i &brick_voxels,
+                              const int mpi_rank)
+{
+    VolumeBrick brick;
 
+    const std::string volume_file = config["volume"].get<std::string>();
     const vec3i volume_dims = get_vec<int, 3>(config["size"]);
-    const vec3f spacing = get_vec<int, 3>(config["spacing"]);
-    const vec3i brick_id(
-        mpi_rank % grid.x, (mpi_rank / grid.x) % grid.y, mpi_rank / (grid.x * grid.y));
 
-    brick.dims = volume_dims / grid;
+    brick.dims = brick_voxels.size();
 
-    const vec3f brick_lower = brick_id * brick.dims;
-    const vec3f brick_upper = brick_id * brick.dims + brick.dims;
+    const vec3f brick_lower = brick_voxels.lower;
+    const vec3f brick_upper = brick_voxels.upper;
 
     brick.bounds = box3f(brick_lower, brick_upper);
 
@@ -100,7 +351,8 @@ VolumeBrick load_volume_brick(json &config, const int mpi_rank, const int mpi_si
     // the local rendering + IceT benchmark
 #if 0
     {
-        const auto ghost_faces = compute_ghost_faces(brick_id, grid);
+        const vec3f spacing = get_vec<int, 3>(config["spacing"]);
+        const auto ghost_faces = compute_ghost_faces(brick_voxels, volume_dims);
         for (size_t i = 0; i < 3; ++i) {
             if (ghost_faces[i] & NEG_FACE) {
                 brick.full_dims[i] += 1;
@@ -114,9 +366,6 @@ VolumeBrick load_volume_brick(json &config, const int mpi_rank, const int mpi_si
         }
     }
 #endif
-    brick.brick = cpp::Volume("structuredRegular");
-    brick.brick.setParam("dimensions", brick.full_dims);
-    brick.brick.setParam("gridSpacing", spacing);
 
     // Load the sub-bricks using MPI I/O
     size_t voxel_size = 0;
@@ -143,7 +392,6 @@ VolumeBrick load_volume_brick(json &config, const int mpi_rank, const int mpi_si
     brick.voxel_data = std::make_shared<std::vector<uint8_t>>(n_voxels * voxel_size, 0);
 
     if (volume_file != "generated") {
-        auto start = high_resolution_clock::now();
         // MPI still uses 32-bit signed ints for counts of objects, so we have to split reads
         // of large data up so the count doesn't overflow. This assumes each X-Y slice is
         // within that size limit and reads chunks
@@ -195,12 +443,6 @@ VolumeBrick load_volume_brick(json &config, const int mpi_rank, const int mpi_si
             MPI_Type_free(&brick_type);
         }
         MPI_File_close(&file_handle);
-
-        auto end = high_resolution_clock::now();
-        if (mpi_rank == 0) {
-            std::cout << "Loading volume brick took "
-                      << duration_cast<milliseconds>(end - start).count() << "ms\n";
-        }
     } else {
         if (voxel_type_string == "uint8") {
             std::fill(brick.voxel_data->begin(),
@@ -221,51 +463,70 @@ VolumeBrick load_volume_brick(json &config, const int mpi_rank, const int mpi_si
         }
     }
 
-    cpp::SharedData osp_data;
-    if (voxel_type_string == "uint8") {
-        osp_data = cpp::SharedData(brick.voxel_data->data(), vec3ul(brick.full_dims));
-    } else if (voxel_type_string == "uint16") {
-        osp_data = cpp::SharedData(reinterpret_cast<uint16_t *>(brick.voxel_data->data()),
-                                   vec3ul(brick.full_dims));
-    } else if (voxel_type_string == "float32") {
-        osp_data = cpp::SharedData(reinterpret_cast<float *>(brick.voxel_data->data()),
-                                   vec3ul(brick.full_dims));
-    } else if (voxel_type_string == "float64") {
-        osp_data = cpp::SharedData(reinterpret_cast<double *>(brick.voxel_data->data()),
-                                   vec3ul(brick.full_dims));
-    } else {
-        std::cerr << "[error]: Unsupported voxel type\n";
-        throw std::runtime_error("[error]: Unsupported voxel type");
+    commit_brick_volume(brick, config);
+    return brick;
+}
+
+std::vector<VolumeBrick> load_volume_bricks(json &config,
+                                            const int mpi_rank,
+                                            const int mpi_size)
+{
+    using namespace std::chrono;
+
+    const std::string volume_file = config["volume"].get<std::string>();
+    if (volume_file == "generated") {
+        // The generated volume is made of a brick_size brick per rank
+        const vec3i brick_dims = get_vec<int, 3>(config["brick_size"]);
+        const vec3i volume_dims = brick_dims * compute_grid(mpi_size);
+        config["size"] = {volume_dims.x, volume_dims.y, volume_dims.z};
+    }
+    int bricks_per_rank = 1;
+    if (config.find("bricks_per_rank") != config.end()) {
+        bricks_per_rank = config["bricks_per_rank"].get<int>();
+        if (bricks_per_rank < 1) {
+            throw std::runtime_error("bricks_per_rank must be at least 1");
+        }
     }
-    brick.brick.setParam("data", osp_data);
 
-    // If the value range wasn't provided, compute it
+    const vec3i volume_dims = get_vec<int, 3>(config["size"]);
+    const KdTree tree(volume_dims, mpi_size, bricks_per_rank);
+    const BrickPlacement placement = compute_brick_placement(mpi_size, bricks_per_rank);
+
+    auto start = high_resolution_clock::now();
+    std::vector<VolumeBrick> bricks;
+    for (const auto &b : placement.rank_bricks[mpi_rank]) {
+        bricks.push_back(load_brick(config, tree.bricks[b], mpi_rank));
+    }
+    auto end = high_resolution_clock::now();
+    if (mpi_rank == 0 && volume_file != "generated") {
+        std::cout << "Loading " << bricks.size() << " volume bricks took "
+                  << duration_cast<milliseconds>(end - start).count() << "ms\n";
+    }
+
+    // If the value range wasn't provided, compute it from the bricks' value ranges
     if (config.find("value_range") == config.end()) {
-        vec2f value_range;
         if (volume_file != "generated") {
-            auto start = high_resolution_clock::now();
-            if (voxel_type == MPI_UNSIGNED_CHAR) {
-                value_range = compute_value_range(brick.voxel_data->data(), n_voxels);
-            } else if (voxel_type == MPI_UNSIGNED_SHORT) {
-                value_range = compute_value_range(
-                    reinterpret_cast<uint16_t *>(brick.voxel_data->data()), n_voxels);
-            } else if (voxel_type == MPI_FLOAT) {
-                value_range = compute_value_range(
-                    reinterpret_cast<float *>(brick.voxel_data->data()), n_voxels);
-            } else if (voxel_type == MPI_DOUBLE) {
-                value_range = compute_value_range(
-                    reinterpret_cast<double *>(brick.voxel_data->data()), n_voxels);
-            } else {
-                std::cerr << "[error]: Unsupported voxel type\n";
-                throw std::runtime_error("[error]: Unsupported voxel type");
+            start = high_resolution_clock::now();
+            vec2f local_value_range = bricks[0].value_range;
+            for (const auto &b : bricks) {
+                local_value_range.x = std::min(local_value_range.x, b.value_range.x);
+                local_value_range.y = std::max(local_value_range.y, b.value_range.y);
             }
             vec2f global_value_range;
-            MPI_Allreduce(
-                &value_range.x, &global_value_range.x, 1, MPI_FLOAT, MPI_MIN, MPI_COMM_WORLD);
-            MPI_Allreduce(
-                &value_range.y, &global_value_range.y, 1, MPI_FLOAT, MPI_MAX, MPI_COMM_WORLD);
+            MPI_Allreduce(&local_value_range.x,
+                          &global_value_range.x,
+                          1,
+                          MPI_FLOAT,
+                          MPI_MIN,
+                          MPI_COMM_WORLD);
+            MPI_Allreduce(&local_value_range.y,
+                          &global_value_range.y,
+                          1,
+                          MPI_FLOAT,
+                          MPI_MAX,
+                          MPI_COMM_WORLD);
 
-            auto end = high_resolution_clock::now();
+            end = high_resolution_clock::now();
 
             if (mpi_rank == 0) {
                 std::cout << "Computed value range: " << global_value_range << "\n"
@@ -277,12 +538,115 @@ VolumeBrick load_volume_brick(json &config, const int mpi_rank, const int mpi_si
             config["value_range"] = {-1, mpi_size - 1};
         }
     }
+    return bricks;
+}
 
-    // Set the clipping box of the volume to clip off the ghost voxels
-    brick.brick.setParam("volumeClippingBoxLower", brick.bounds.lower);
-    brick.brick.setParam("volumeClippingBoxUpper", brick.bounds.upper);
-    brick.brick.commit();
-    return brick;
+std::vector<VolumeBrick> migrate_bricks(const json &config,
+                                        const std::vector<VolumeBrick> &bricks,
+                                        const KdTree &prev_tree,
+                                        const KdTree &tree,
+                                        const BrickPlacement &placement,
+                                        const int mpi_rank)
+{
+    const std::string voxel_type_string = config["type"].get<std::string>();
+    int voxel_size = 0;
+    if (voxel_type_string == "uint8") {
+        voxel_size = 1;
+    } else if (voxel_type_string == "uint16") {
+        voxel_size = 2;
+    } else if (voxel_type_string == "float32") {
+        voxel_size = 4;
+    } else if (voxel_type_string == "float64") {
+        voxel_size = 8;
+    } else {
+        throw std::runtime_error("Unrecognized voxel type " + voxel_type_string);
+    }
+
+    const std::vector<int> &rank_bricks = placement.rank_bricks[mpi_rank];
+    std::vector<VolumeBrick> migrated(rank_bricks.size());
+    for (size_t i = 0; i < rank_bricks.size(); ++i) {
+        const box3i brick_voxels = tree.bricks[rank_bricks[i]];
+        VolumeBrick &brick = migrated[i];
+        brick.dims = brick_voxels.size();
+        brick.full_dims = brick.dims;
+        brick.bounds = box3f(vec3f(brick_voxels.lower), vec3f(brick_voxels.upper));
+        brick.ghost_bounds = brick.bounds;
+        brick.voxel_data = std::make_shared<std::vector<uint8_t>>(
+            brick.dims.long_product() * voxel_size, 0);
+    }
+
+    // The piece of the brick's voxels overlapping the other box, with the X axis in
+    // bytes so the pieces can be sent as bytes for any voxel type
+    auto overlap_type = [&](const box3i &brick, const box3i &overlap) {
+        const vec3i brick_dims = brick.size() * vec3i(voxel_size, 1, 1);
+        const vec3i overlap_dims = overlap.size() * vec3i(voxel_size, 1, 1);
+        const vec3i offset = (overlap.lower - brick.lower) * vec3i(voxel_size, 1, 1);
+        MPI_Datatype type;
+        MPI_Type_create_subarray(3,
+                                 &brick_dims.x,
+                                 &overlap_dims.x,
+                                 &offset.x,
+                                 MPI_ORDER_FORTRAN,
+                                 MPI_BYTE,
+                                 &type);
+        MPI_Type_commit(&type);
+        return type;
+    };
+
+    /* Both sides walk the overlapping pairs of previous and new bricks in the same
+     * order, so the messages between each pair of ranks match up in order. Pieces
+     * staying on this rank are sent to ourself
+     */
+    std::vector<MPI_Request> requests;
+    std::vector<MPI_Datatype> types;
+    for (size_t i = 0; i < prev_tree.bricks.size(); ++i) {
+        const int sender = placement.brick_owners[i];
+        for (size_t j = 0; j < tree.bricks.size(); ++j) {
+            const int receiver = placement.brick_owners[j];
+            if (sender != mpi_rank && receiver != mpi_rank) {
+                continue;
+            }
+            const box3i overlap = intersectionOf(prev_tree.bricks[i], tree.bricks[j]);
+            if (overlap.empty() || overlap.size().long_product() == 0) {
+                continue;
+            }
+            if (receiver == mpi_rank) {
+                const size_t b =
+                    std::find(rank_bricks.begin(), rank_bricks.end(), j) - rank_bricks.begin();
+                types.push_back(overlap_type(tree.bricks[j], overlap));
+                requests.push_back(MPI_REQUEST_NULL);
+                MPI_Irecv(migrated[b].voxel_data->data(),
+                          1,
+                          types.back(),
+                          sender,
+                          0,
+                          MPI_COMM_WORLD,
+                          &requests.back());
+            }
+            if (sender == mpi_rank) {
+                const size_t b =
+                    std::find(rank_bricks.begin(), rank_bricks.end(), i) - rank_bricks.begin();
+                types.push_back(overlap_type(prev_tree.bricks[i], overlap));
+                requests.push_back(MPI_REQUEST_NULL);
+                MPI_Isend(bricks[b].voxel_data->data(),
+                          1,
+                          types.back(),
+                          receiver,
+                          0,
+                          MPI_COMM_WORLD,
+                          &requests.back());
+            }
+        }
+    }
+    MPI_Waitall(requests.size(), requests.data(), MPI_STATUSES_IGNORE);
+    for (auto &t : types) {
+        MPI_Type_free(&t);
+    }
+
+    for (auto &brick : migrated) {
+        commit_brick_volume(brick, config);
+    }
+    return migrated;
 }
 
 std::vector<Camera> load_cameras(const json &c, const box3f &world_bounds)
@@ -302,7 +666,9 @@ std::vector<Camera> load_cameras(const json &c, const box3f &world_bounds)
     return cameras;
 }
 
-cpp::TransferFunction load_colormap(const std::string &f, const vec2f &value_range)
+cpp::TransferFunction load_colormap(const std::string &f,
+                                    const vec2f &value_range,
+                                    std::vector<float> &opacities)
 {
     cpp::TransferFunction tfn("piecewiseLinear");
     int x, y, n;
@@ -313,7 +679,7 @@ cpp::TransferFunction load_colormap(const std::string &f, const vec2f &value_ran
     }
 
     std::vector<vec3f> colors;
-    std::vector<float> opacities;
+    opacities.clear();
     for (int i = 0; i < x; ++i) {
         colors.emplace_back(
             data[i * 4] / 255.f, data[i * 4 + 1] / 255.f, data[i * 4 + 2] / 255.f);
@@ -332,3 +698,62 @@ cpp::TransferFunction load_colormap(const std::string &f, const vec2f &value_ran
     tfn.commit();
     return tfn;
 }
+
+bool BrickCuller::transparent(const vec2f &values) const
+{
+    if (opacities.empty()) {
+        return false;
+    }
+    // Values outside the transfer function's range are clamped to its ends. The
+    // opacity is interpolated linearly between the samples, so the values are only
+    // transparent if all samples covering them are zero
+    const float range = value_range.y - value_range.x;
+    const float max_sample = opacities.size() - 1;
+    auto sample = [&](const float v) {
+        const float s = range > 0.f ? (v - value_range.x) / range * max_sample : 0.f;
+        return std::min(std::max(s, 0.f), max_sample);
+    };
+    const size_t lo = std::floor(sample(values.x));
+    const size_t hi = std::ceil(sample(values.y));
+    for (size_t i = lo; i <= hi; ++i) {
+        if (opacities[i] > 0.f) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool BrickCuller::outside_frustum(const box3f &bounds, const Camera &camera) const
+{
+    const vec3f dir = normalize(camera.dir);
+    const vec3f right = normalize(cross(dir, camera.up));
+    const vec3f up = cross(right, dir);
+    const float tan_y = std::tan(fovy * float(M_PI) / 360.f);
+    const float tan_x = tan_y * aspect;
+
+    // The inward facing normals of the frustum's side planes and the near plane at
+    // the camera position, which all pass through the camera position
+    const std::array<vec3f, 5> planes = {tan_x * dir - right,
+                                         tan_x * dir + right,
+                                         tan_y * dir - up,
+                                         tan_y * dir + up,
+                                         dir};
+    for (const auto &n : planes) {
+        bool all_outside = true;
+        for (int i = 0; i < 8 && all_outside; ++i) {
+            const vec3f corner(i & 1 ? bounds.upper.x : bounds.lower.x,
+                               i & 2 ? bounds.upper.y : bounds.lower.y,
+                               i & 4 ? bounds.upper.z : bounds.lower.z);
+            all_outside = dot(n, corner - camera.pos) < 0.f;
+        }
+        if (all_outside) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool BrickCuller::culled(const VolumeBrick &brick, const Camera &camera) const
+{
+    return transparent(brick.value_range) || outside_frustum(brick.bounds, camera);
+}
@@ -31,6 +31,8 @@ struct VolumeBrick {
     vec3i full_dims;
 
     std::shared_ptr<std::vector<uint8_t>> voxel_data;
+    // the range of the voxel values in the brick
+    vec2f value_range;
 };
 
 struct Camera {
@@ -38,6 +40,8 @@ struct Camera {
     vec3f dir;
     vec3f up;
 
+    Camera() = default;
+
     Camera(const vec3f &pos, const vec3f &dir, const vec3f &up);
 };
 
@@ -49,15 +53,122 @@ bool compute_divisor(int x, int &divisor);
  */
 vec3i compute_grid(int num);
 
+/* A k-d tree decomposition of the volume into bricks. Each node's box is split along
+ * its longest axis, with the bricks divided between the two children and the split
+ * placed in proportion to their brick counts, so the bricks are near cubic for any
+ * number of bricks. Walking the tree from the camera gives the exact visibility
+ * order of the bricks.
+ *
+ * When over-decomposing with several bricks per rank, the volume is first split
+ * between the ranks and then each rank's subtree is split into its bricks. Each
+ * rank's bricks are thus a subtree, which is contiguous in the visibility order.
+ */
+struct KdTree {
+    struct Node {
+        box3i bounds;
+        // Inner nodes split the bounds along the axis at split, the lower child is the
+        // next node and upper the index of the upper child. Leaves hold their brick
+        int axis = -1;
+        int split = 0;
+        int upper = -1;
+        int brick = -1;
+    };
+    std::vector<Node> nodes;
+    // The voxel bounds of each brick, indexed in the order of the tree's leaves
+    std::vector<box3i> bricks;
+    int bricks_per_rank = 1;
+
+    KdTree() = default;
+
+    KdTree(const vec3i &volume_dims, const int num_ranks, const int bricks_per_rank = 1);
+
+    /* Rebuild the tree with the split planes between the ranks' subtrees placed to
+     * balance their cost, given the cost of each brick of the previous tree which is
+     * assumed to be spread evenly over its voxels. Each rank's subtree is still split
+     * evenly into its bricks, and the new tree has the same leaves as the previous one
+     */
+    KdTree(const KdTree &prev, const std::vector<double> &brick_costs);
+
+    // The bricks in front-to-back order from the position
+    std::vector<int> front_to_back(const vec3f &pos) const;
+
+private:
+    int build(const box3i &bounds,
+              const int num_bricks,
+              const KdTree *prev = nullptr,
+              const std::vector<double> *brick_costs = nullptr);
+};
+
+/* The placement of the bricks of the k-d tree on the ranks. The ranks are grouped by
+ * the node they run on, and nodes by the group given for their hostname in the
+ * optional topology hint file, and then assigned the ranks' subtrees of bricks in
+ * the order of the tree's leaves. Each node and group of nodes thus owns a compact
+ * block of neighboring bricks, so the first compositing rounds mostly exchange
+ * images between ranks on the same node.
+ */
+struct BrickPlacement {
+    // The bricks owned by each rank and the rank owning each brick
+    std::vector<std::vector<int>> rank_bricks;
+    std::vector<int> brick_owners;
+};
+
+/* Place the bricks on num_ranks ranks of MPI_COMM_WORLD, which is all the ranks or
+ * a single one for image-parallel rendering. The topology hint file is read from the
+ * OSP_TOPOLOGY_FILE env var and lists "<hostname> <group>" per line, e.g. the switch
+ * or rack of each node. Collective when num_ranks > 1
+ */
+BrickPlacement compute_brick_placement(const int num_ranks, const int bricks_per_rank = 1);
+
 enum GhostFace { NEITHER_FACE = 0, POS_FACE = 1, NEG_FACE = 2 };
 
 /* Compute which faces of this brick we need to specify ghost voxels
  * for to have correct interpolation at brick boundaries.
  */
-std::array<int, 3> compute_ghost_faces(const vec3i &brick_id, const vec3i &grid);
+std::array<int, 3> compute_ghost_faces(const box3i &brick, const vec3i &volume_dims);
+
+/* Load the bricks owned by this rank, "bricks_per_rank" in the config over-decomposes
+ * the rank's part of the volume into that many bricks
+ */
+std::vector<VolumeBrick> load_volume_bricks(json &config,
+                                            const int mpi_rank,
+                                            const int mpi_size);
 
-VolumeBrick load_volume_brick(json &config, const int mpi_rank, const int mpi_size);
+/* Move the voxels of this rank's bricks in the previous tree to its bricks in the new
+ * tree, with the bricks placed on the same ranks in both. Each piece of a previous
+ * brick overlapping a new brick is sent directly to the new brick's owner.
+ * Collective
+ */
+std::vector<VolumeBrick> migrate_bricks(const json &config,
+                                        const std::vector<VolumeBrick> &bricks,
+                                        const KdTree &prev_tree,
+                                        const KdTree &tree,
+                                        const BrickPlacement &placement,
+                                        const int mpi_rank);
 
 std::vector<Camera> load_cameras(const json &camera_param, const box3f &world_bounds);
 
-cpp::TransferFunction load_colormap(const std::string &file, const vec2f &value_range);
+// Load the colormap image as a transfer function, also returning its opacities
+cpp::TransferFunction load_colormap(const std::string &file,
+                                    const vec2f &value_range,
+                                    std::vector<float> &opacities);
+
+/* Culls the bricks which can't contribute to the image, either because they're
+ * outside the camera's view frustum or because the transfer function maps all their
+ * values to zero opacity. Both tests are conservative.
+ */
+struct BrickCuller {
+    // The transfer function's opacities, evenly spaced over its value range
+    std::vector<float> opacities;
+    vec2f value_range;
+    // The perspective camera's vertical field of view in degrees and aspect ratio
+    float fovy = 60.f;
+    float aspect = 1.f;
+
+    // Check if the transfer function maps all values in the range to zero opacity
+    bool transparent(const vec2f &values) const;
+
+    // Check if the box is entirely outside the camera's view frustum
+    bool outside_frustum(const box3f &bounds, const Camera &camera) const;
+
+    bool culled(const VolumeBrick &brick, const Camera &camera) const;
+};
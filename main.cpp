@@ -1,8 +1,14 @@
 #include <algorithm>
 #include <chrono>
+#include <cmath>
 #include <cstdio>
+#include <fstream>
 #include <iostream>
+#include <limits>
 #include <memory>
+#include <numeric>
+#include <sstream>
+#include <stdexcept>
 #include <thread>
 #include <mpi.h>
 #include <ospray/ospray.h>
@@ -33,10 +39,19 @@ int mpi_size = 0;
 box3f world_bounds;
 json config;
 std::string prefix;
-bool use_ospray_compositing = true;
+// One of dfb, icet, bswap, radixk, twothree or directsend
+std::string compositor = "dfb";
 bool save_images = true;
 bool detailed_cpu_stats = false;
 bool image_parallel = false;
+bool pipeline_frames = false;
+bool mpi_io_output = false;
+// Render each view at 1/progressive_factor of the image size on each axis first
+int progressive_factor = 1;
+// Render and composite up to batch_views views sharing a composite order together
+int batch_views = 1;
+// Pick IceT's fastest single image strategy by timing them on the first view
+bool icet_autotune = false;
 
 const std::string USAGE =
     "./osp_icet <config.json> [options]\n"
@@ -45,11 +60,45 @@ const std::string USAGE =
     "  -dfb                 Use OSPRay for rendering and compositing.\n"
 #if ICET_ENABLED
     "  -icet                Use OSPRay for local rendering only, and IceT for compositing.\n"
+    "                       The framebuffer is passed to IceT without a copy, set\n"
+    "                       OSP_ICET_DRAW_CALLBACK=1 to copy it in IceT's draw callback.\n"
+    "  -icet-autotune       Time each of IceT's single image strategies over a few frames\n"
+    "                       of the first view and use the fastest, instead of the one set\n"
+    "                       by OSP_ICET_STRATEGY. The choice for the rank count, image size\n"
+    "                       and volume is cached in \"icet_autotune_cache\" from the config\n"
+    "                       (default icet_autotune.json) and reused by later runs.\n"
 #endif
-    "  -img-parallel        Render image-parallel with replicated data\n"
+    "  -bswap               Use OSPRay for local rendering, and binary swap for compositing.\n"
+    "  -radixk              Use OSPRay for local rendering, and radix-k for compositing.\n"
+    "                       The k-values are read from \"radix_k\" in the config or the\n"
+    "                       OSP_RADIX_K env var (e.g. OSP_RADIX_K=8,8,4).\n"
+    "  -twothree            Use OSPRay for local rendering, and 2-3 swap for compositing.\n"
+    "  -directsend          Use OSPRay for local rendering, and direct-send for compositing.\n"
+    "                       The tile size is read from \"tile_size\" in the config, and\n"
+    "                       \"stream_bands\" > 1 renders the frame in that many bands,\n"
+    "                       sending each band's tiles while the next one renders.\n"
+    "  -image-parallel      Render image-parallel with replicated data. The image is split\n"
+    "                       into \"tile_size\" tiles, and ranks which finish their share\n"
+    "                       of the tiles steal the remaining tiles of the other ranks.\n"
+    "  -pipeline            Render the next frame while compositing the current one.\n"
+    "                       Only supported by the native compositors without streaming\n"
+    "                       bands.\n"
+    "  -progressive <n>     Render and composite each view at 1/n of the image size on\n"
+    "                       each axis first (e.g. 2 or 4 for 1/4 or 1/16 of the pixels),\n"
+    "                       then at the full size.\n"
+    "  -batch-views <n>     Render up to n consecutive views with the same composite order\n"
+    "                       as layers of one image, compositing them in a single exchange.\n"
+    "                       Only supported by the native compositors.\n"
+    "  -mpi-io-output       Save the images as PPMs written with MPI-IO by the ranks owning\n"
+    "                       each piece of the image, instead of gathering them to rank 0.\n"
     "  -no-output           Don't save images of the rendered results.\n"
     "  -detailed-stats      Record and print statistics about CPU use, thread pinning, etc.\n"
-    "  -h                   Print this help.";
+    "  -h                   Print this help.\n"
+    "The bricks are placed on the ranks by node, and by the groups of nodes listed as\n"
+    "\"<hostname> <group>\" lines in the file given by the OSP_TOPOLOGY_FILE env var.\n"
+    "With IceT and the native compositors, \"display_wall\": {\"tiles\": [x, y],\n"
+    "\"display_ranks\": [...]} in the config sends each tile of the image to its display\n"
+    "rank, which saves just its tile.";
 
 void render_images(const std::string &cfg_file_name);
 
@@ -82,12 +131,30 @@ int main(int argc, char **argv)
             prefix = args[++i] + "-";
 #if ICET_ENABLED
         } else if (args[i] == "-icet") {
-            use_ospray_compositing = false;
+            compositor = "icet";
+        } else if (args[i] == "-icet-autotune") {
+            icet_autotune = true;
 #endif
         } else if (args[i] == "-dfb") {
-            use_ospray_compositing = true;
+            compositor = "dfb";
+        } else if (args[i] == "-bswap") {
+            compositor = "bswap";
+        } else if (args[i] == "-radixk") {
+            compositor = "radixk";
+        } else if (args[i] == "-twothree") {
+            compositor = "twothree";
+        } else if (args[i] == "-directsend") {
+            compositor = "directsend";
         } else if (args[i] == "-image-parallel") {
             image_parallel = true;
+        } else if (args[i] == "-pipeline") {
+            pipeline_frames = true;
+        } else if (args[i] == "-progressive") {
+            progressive_factor = std::stoi(args[++i]);
+        } else if (args[i] == "-batch-views") {
+            batch_views = std::stoi(args[++i]);
+        } else if (args[i] == "-mpi-io-output") {
+            mpi_io_output = true;
         } else if (args[i] == "-no-output") {
             save_images = false;
         } else if (args[i] == "-detailed-stats") {
@@ -120,25 +187,29 @@ int main(int argc, char **argv)
         MPI_Barrier(MPI_COMM_WORLD);
     }
 
-    if (use_ospray_compositing) {
-        prefix = prefix + "dfb-";
-    } else {
-        prefix = prefix + "icet-";
-    }
+    prefix = prefix + compositor + "-";
 
     if (mpi_rank == 0) {
         std::cout << "Rendering Config: " << config.dump() << "\n" << std::flush;
-        if (use_ospray_compositing) {
+        if (compositor == "dfb") {
             std::cout << "Using OSPRay's DFB for compositing\n";
-        } else {
+        } else if (compositor == "icet") {
             std::cout << "Using IceT for compositing\n";
+        } else if (compositor == "bswap") {
+            std::cout << "Using binary swap for compositing\n";
+        } else if (compositor == "radixk") {
+            std::cout << "Using radix-k for compositing\n";
+        } else if (compositor == "twothree") {
+            std::cout << "Using 2-3 swap for compositing\n";
+        } else {
+            std::cout << "Using direct-send for compositing\n";
         }
     }
     MPI_Barrier(MPI_COMM_WORLD);
 
     {
         cpp::Device device(nullptr);
-        if (use_ospray_compositing) {
+        if (compositor == "dfb") {
             ospLoadModule("mpi_distributed_cpu");
             device = cpp::Device("mpiDistributed");
             device.commit();
@@ -177,52 +248,270 @@ void render_images(const std::string &cfg_file_name)
         std::cout << "Data parallel rendering\n";
     }
 
-    VolumeBrick brick = load_volume_brick(
+    std::vector<VolumeBrick> bricks = load_volume_bricks(
         config, image_parallel ? 0 : mpi_rank, image_parallel ? 1 : mpi_size);
+    const int bricks_per_rank = bricks.size();
 
     const vec3i volume_dims = get_vec<int, 3>(config["size"]);
     world_bounds = box3f(vec3f(0), vec3f(volume_dims));
     const vec2f value_range = get_vec<float, 2>(config["value_range"]);
     const vec2i img_size = get_vec<int, 2>(config["image_size"]);
-    const auto colormap =
-        load_colormap(cfg_file_path + config["colormap"].get<std::string>(), value_range);
+    std::vector<float> opacities;
+    const auto colormap = load_colormap(
+        cfg_file_path + config["colormap"].get<std::string>(), value_range, opacities);
     const auto camera_set = load_cameras(config["camera"].get<json>(), world_bounds);
     vec3f bg_color(0.f);
     if (config.find("bg_color") != config.end()) {
         bg_color = get_vec<float, 3>(config["bg_color"]);
     }
 
-    std::unique_ptr<RenderBackend> backend;
-    if (use_ospray_compositing) {
-        backend = std::make_unique<OSPRayDFBBackend>(img_size, detailed_cpu_stats, bg_color);
-    } else {
+    CompositeOptions composite_options;
+    if (config.find("rle") != config.end()) {
+        composite_options.rle = config["rle"].get<bool>();
+    }
+    if (config.find("pixel_format") != config.end()) {
+        composite_options.format =
+            parse_pixel_format(config["pixel_format"].get<std::string>());
+    }
+    if (config.find("report_precision_error") != config.end()) {
+        composite_options.report_precision_error =
+            config["report_precision_error"].get<bool>();
+    }
+    if (config.find("node_local_compositing") != config.end()) {
+        composite_options.node_local = config["node_local_compositing"].get<bool>();
+    }
+    if (config.find("lossy_error_bound") != config.end()) {
+        // Either a single bound for all channels or one per RGBA channel
+        const json &bound = config["lossy_error_bound"];
+        composite_options.error_bound =
+            bound.is_array() ? get_vec<float, 4>(bound) : vec4f(bound.get<float>());
+        // Bounds below the float precision of the [0, 1] channels can't be met by
+        // quantizing them, and would overflow the 32 bit quantized offsets. A zero bound
+        // keeps the channel lossless
+        for (int c = 0; c < 4; ++c) {
+            const float b = composite_options.error_bound[c];
+            if (b != 0.f && !(b >= std::ldexp(1.f, -24))) {
+                throw std::runtime_error(
+                    "lossy_error_bound must be 0 or at least 2^-24 for each channel");
+            }
+        }
+    }
+    if (config.find("temporal_delta") != config.end()) {
+        composite_options.temporal_delta = config["temporal_delta"].get<bool>();
+    }
+    if (composite_options.temporal_delta &&
+        (composite_options.lossy() || compositor == "directsend")) {
+        if (mpi_rank == 0) {
+            std::cerr << "[warning]: Temporal delta encoding is only supported by the "
+                      << "schedule compositors with lossless compression and is disabled\n";
+        }
+        composite_options.temporal_delta = false;
+    }
+
+    int tile_size = 64;
+    if (config.find("tile_size") != config.end()) {
+        tile_size = config["tile_size"].get<int>();
+    }
+    int stream_bands = 1;
+    if (config.find("stream_bands") != config.end()) {
+        stream_bands = config["stream_bands"].get<int>();
+    }
+    std::vector<int> k_values;
+    if (config.find("radix_k") != config.end()) {
+        k_values = config["radix_k"].get<std::vector<int>>();
+    }
+    const std::string env_k_values = get_env("OSP_RADIX_K");
+    if (!env_k_values.empty()) {
+        k_values.clear();
+        std::stringstream ss(env_k_values);
+        std::string k;
+        while (std::getline(ss, k, ',')) {
+            k_values.push_back(std::stoi(k));
+        }
+    }
+
+    // Create the backend for the compositor used, rendering images of the given size
+    auto make_backend = [&](const vec2i &size) {
+        std::unique_ptr<RenderBackend> backend;
+        if (image_parallel) {
+            backend = std::make_unique<ImageParallelBackend>(
+                size, detailed_cpu_stats, bg_color, tile_size);
+        } else if (compositor == "dfb") {
+            backend = std::make_unique<OSPRayDFBBackend>(size, detailed_cpu_stats, bg_color);
+        } else if (compositor == "bswap") {
+            backend = std::make_unique<BinarySwapBackend>(size,
+                                                          volume_dims,
+                                                          bricks_per_rank,
+                                                          detailed_cpu_stats,
+                                                          bg_color,
+                                                          composite_options);
+        } else if (compositor == "radixk") {
+            backend = std::make_unique<RadixKBackend>(size,
+                                                      volume_dims,
+                                                      bricks_per_rank,
+                                                      detailed_cpu_stats,
+                                                      bg_color,
+                                                      composite_options,
+                                                      k_values);
+        } else if (compositor == "twothree") {
+            backend = std::make_unique<TwoThreeSwapBackend>(size,
+                                                            volume_dims,
+                                                            bricks_per_rank,
+                                                            detailed_cpu_stats,
+                                                            bg_color,
+                                                            composite_options);
+        } else if (compositor == "directsend") {
+            backend = std::make_unique<DirectSendBackend>(size,
+                                                          volume_dims,
+                                                          bricks_per_rank,
+                                                          detailed_cpu_stats,
+                                                          bg_color,
+                                                          composite_options,
+                                                          tile_size,
+                                                          stream_bands);
+        } else {
 #if ICET_ENABLED
-        backend =
-            std::make_unique<IceTBackend>(img_size, volume_dims, detailed_cpu_stats, bg_color);
+            backend = std::make_unique<IceTBackend>(
+                size, volume_dims, bricks_per_rank, detailed_cpu_stats, bg_color);
 #else
-        std::cout
-            << "ERROR: IceT support must be compiled in to compare with IceT compositing\n";
-        std::exit(1);
+            std::cout << "ERROR: IceT support must be compiled in to compare with IceT "
+                      << "compositing\n";
+            std::exit(1);
 #endif
+        }
+        backend->distributed_output = save_images && mpi_io_output;
+        return backend;
+    };
+
+    // Batched views are stacked as layers of one image, which is composited by the
+    // native compositors a batch at a time
+    const bool native_compositor =
+        !image_parallel && compositor != "dfb" && compositor != "icet";
+    if (batch_views > 1 && (!native_compositor || pipeline_frames || progressive_factor > 1 ||
+                            config.find("display_wall") != config.end())) {
+        if (mpi_rank == 0) {
+            std::cerr << "[warning]: Batched views are only supported by the native "
+                      << "compositors without pipelining, progressive rendering or a "
+                      << "display wall and are disabled\n";
+        }
+        batch_views = 1;
+    }
+    std::unique_ptr<RenderBackend> backend =
+        make_backend(vec2i(img_size.x, img_size.y * std::max(batch_views, 1)));
+    backend->num_layers = std::max(batch_views, 1);
+    if (pipeline_frames && !backend->pipelines_frames()) {
+        if (mpi_rank == 0) {
+            std::cerr << "[warning]: Pipelined rendering is only supported by the native "
+                      << "compositors without streaming bands and is disabled\n";
+        }
+        pipeline_frames = false;
+    }
+
+    // With progressive rendering each view is first rendered and composited at a reduced
+    // resolution by a second backend, giving a preview image before the full one
+    std::unique_ptr<RenderBackend> preview_backend;
+    if (progressive_factor > 1 && pipeline_frames) {
+        if (mpi_rank == 0) {
+            std::cerr << "[warning]: Progressive rendering is not supported with pipelined "
+                      << "rendering and is disabled\n";
+        }
+    } else if (progressive_factor > 1) {
+        preview_backend = make_backend(max(img_size / progressive_factor, vec2i(1)));
+    }
+
+    // On a display wall each display rank receives just its tile of the final image.
+    // The preview images are still gathered to rank 0
+    DisplayWall display_wall;
+    if (config.find("display_wall") != config.end()) {
+        const json &wall_config = config["display_wall"];
+        std::vector<int> display_ranks;
+        if (wall_config.find("display_ranks") != wall_config.end()) {
+            display_ranks = wall_config["display_ranks"].get<std::vector<int>>();
+        }
+        display_wall = DisplayWall(
+            img_size, get_vec<int, 2>(wall_config["tiles"]), display_ranks, mpi_size);
+        if (!backend->set_display_wall(display_wall)) {
+            if (mpi_rank == 0) {
+                std::cerr << "[warning]: Display walls are only supported by IceT and the "
+                          << "native compositors and are disabled\n";
+            }
+            display_wall = DisplayWall();
+        }
+    }
+
+    // Ranks whose bricks are all outside the view or fully transparent skip rendering
+    // each frame. With image-parallel rendering every rank renders part of the whole
+    // volume
+    bool culling = !image_parallel;
+    if (config.find("culling") != config.end()) {
+        culling = culling && config["culling"].get<bool>();
     }
+    BrickCuller culler;
+    culler.opacities = opacities;
+    culler.value_range = value_range;
+    culler.aspect = static_cast<float>(img_size.x) / img_size.y;
+    auto brick_culled = [&](const size_t i) {
+        return culling && std::all_of(bricks.begin(), bricks.end(), [&](const auto &b) {
+                   return culler.culled(b, camera_set[i]);
+               });
+    };
 
-    cpp::VolumetricModel model(brick.brick);
-    model.setParam("transferFunction", colormap);
-    model.commit();
+    // Each brick is its own instance, with its bounds as a region for the DFB
+    auto make_world = [&]() {
+        std::vector<cpp::Instance> instances;
+        std::vector<box3f> regions;
+        for (const auto &brick : bricks) {
+            cpp::VolumetricModel model(brick.brick);
+            model.setParam("transferFunction", colormap);
+            model.commit();
 
-    cpp::Group group;
-    group.setParam("volume", cpp::SharedData(model));
-    group.commit();
+            cpp::Group group;
+            group.setParam("volume", cpp::SharedData(model));
+            group.commit();
 
-    cpp::Instance instance(group);
-    auto transform = affine3f::translate(brick.ghost_bounds.lower);
-    instance.setParam("xfm", transform);
-    instance.commit();
+            cpp::Instance instance(group);
+            auto transform = affine3f::translate(brick.ghost_bounds.lower);
+            instance.setParam("xfm", transform);
+            instance.commit();
 
-    cpp::World world;
-    world.setParam("instance", cpp::SharedData(instance));
-    world.setParam("region", cpp::SharedData(brick.bounds));
-    world.commit();
+            instances.push_back(instance);
+            regions.push_back(brick.bounds);
+        }
+
+        cpp::World world;
+        world.setParam("instance", cpp::CopiedData(instances));
+        world.setParam("region", cpp::CopiedData(regions));
+        world.commit();
+        return world;
+    };
+    cpp::World world = make_world();
+
+    // Every rebalance_interval frames the bricks are rebalanced from the ranks' local
+    // render times over those frames, which needs the frames to be rendered one at a
+    // time and each rank to own its own part of the volume
+    int rebalance_interval = 0;
+    if (config.find("rebalance_interval") != config.end()) {
+        rebalance_interval = config["rebalance_interval"].get<int>();
+    }
+    if (rebalance_interval > 0 && (image_parallel || pipeline_frames || batch_views > 1)) {
+        if (mpi_rank == 0) {
+            std::cerr << "[warning]: Rebalancing is not supported with image-parallel, "
+                      << "pipelined or batched rendering and is disabled\n";
+        }
+        rebalance_interval = 0;
+    }
+    KdTree volume_tree;
+    BrickPlacement brick_placement;
+    if (rebalance_interval > 0 || batch_views > 1) {
+        volume_tree = KdTree(volume_dims, mpi_size, bricks_per_rank);
+        brick_placement = compute_brick_placement(mpi_size, bricks_per_rank);
+    }
+    double interval_render_time = 0.0;
+    int interval_frames = 0;
+    double initial_imbalance = -1.0;
+    double final_imbalance = -1.0;
+    size_t total_preview_time = 0;
+    size_t total_final_time = 0;
 
     if (mpi_rank == 0) {
         std::cout << "Beginning rendering\n";
@@ -231,31 +520,330 @@ void render_images(const std::string &cfg_file_name)
     const std::string fmt_string =
         "%0" + std::to_string(static_cast<int>(std::log10(camera_set.size())) + 1) + "d";
     std::string fmt_out_buf(static_cast<int>(std::log10(camera_set.size())) + 1, '0');
-    for (size_t i = 0; i < camera_set.size(); ++i) {
+    auto make_camera = [&](const size_t i) {
         cpp::Camera camera("perspective");
         camera.setParam("aspect", static_cast<float>(img_size.x) / img_size.y);
         camera.setParam("position", camera_set[i].pos);
         camera.setParam("direction", camera_set[i].dir);
         camera.setParam("up", camera_set[i].up);
         camera.commit();
+        return camera;
+    };
+    auto frame_file_name = [&](const size_t i) {
+        std::sprintf(&fmt_out_buf[0], fmt_string.c_str(), static_cast<int>(i));
+        return prefix + "osp-icet-" + fmt_out_buf;
+    };
+
+#if ICET_ENABLED
+    // The autotuned strategy is only used for the final images, the preview images are
+    // a different size and keep the default strategy
+    IceTBackend *icet_backend = dynamic_cast<IceTBackend *>(backend.get());
+    if (icet_autotune && !icet_backend && mpi_rank == 0) {
+        std::cerr << "[warning]: Autotuning is only supported by IceT and is disabled\n";
+    }
+    if (icet_autotune && icet_backend && !camera_set.empty()) {
+        const std::vector<std::string> strategies = {"BSWAP", "RADIXK", "TREE"};
+        const int autotune_frames = 3;
+        std::string cache_file = "icet_autotune.json";
+        if (config.find("icet_autotune_cache") != config.end()) {
+            cache_file = config["icet_autotune_cache"].get<std::string>();
+        }
+        const vec3i dims = get_vec<int, 3>(config["size"]);
+        std::string setup = std::to_string(mpi_size) + " ranks, " +
+                            std::to_string(img_size.x) + "x" + std::to_string(img_size.y) +
+                            ", " + config["volume"].get<std::string>() + " " +
+                            std::to_string(dims.x) + "x" + std::to_string(dims.y) + "x" +
+                            std::to_string(dims.z) + ", " +
+                            std::to_string(bricks_per_rank) + " bricks per rank";
+        if (!display_wall.empty()) {
+            setup += ", " + std::to_string(display_wall.tiles.size()) + " display tiles";
+        }
+
+        // Rank 0 looks up the setup in the cache and shares the cached strategy
+        json cache;
+        int best = -1;
+        if (mpi_rank == 0) {
+            try {
+                std::ifstream cache_in(cache_file.c_str());
+                if (cache_in) {
+                    cache_in >> cache;
+                }
+                if (!cache.is_object()) {
+                    cache = json::object();
+                }
+                if (cache.find(setup) != cache.end()) {
+                    auto fnd = std::find(strategies.begin(),
+                                         strategies.end(),
+                                         cache[setup].get<std::string>());
+                    if (fnd != strategies.end()) {
+                        best = std::distance(strategies.begin(), fnd);
+                    }
+                }
+            } catch (const json::exception &e) {
+                std::cerr << "[warning]: Ignoring invalid autotune cache " << cache_file
+                          << ": " << e.what() << "\n";
+                cache = json::object();
+            }
+        }
+        MPI_Bcast(&best, 1, MPI_INT, 0, MPI_COMM_WORLD);
 
-        auto render_time = backend->render(camera, world, camera_set[i].pos);
+        if (best == -1) {
+            // Each strategy's time is the fastest of its frames, after the first one
+            // which warms up IceT's buffers. The frames are timed by IceT's draw time
+            // as the render time is in whole milliseconds
+            double best_time = std::numeric_limits<double>::infinity();
+            for (size_t s = 0; s < strategies.size(); ++s) {
+                icet_backend->set_single_image_strategy(strategies[s]);
+                double strategy_time = std::numeric_limits<double>::infinity();
+                for (int f = 0; f < autotune_frames + 1; ++f) {
+                    backend->render(make_camera(0), world, camera_set[0], brick_culled(0));
+                    const double local_time = icet_backend->draw_time;
+                    double frame_time = 0.0;
+                    MPI_Reduce(&local_time,
+                               &frame_time,
+                               1,
+                               MPI_DOUBLE,
+                               MPI_MAX,
+                               0,
+                               MPI_COMM_WORLD);
+                    if (f > 0) {
+                        strategy_time = std::min(strategy_time, frame_time);
+                    }
+                }
+                if (mpi_rank == 0) {
+                    std::cout << "IceT Autotune " << strategies[s] << ": " << strategy_time
+                              << "ms\n";
+                    if (strategy_time < best_time) {
+                        best_time = strategy_time;
+                        best = s;
+                    }
+                }
+            }
+            MPI_Bcast(&best, 1, MPI_INT, 0, MPI_COMM_WORLD);
+            if (mpi_rank == 0) {
+                cache[setup] = strategies[best];
+                std::ofstream cache_out(cache_file.c_str());
+                cache_out << cache.dump(4) << "\n";
+                if (!cache_out) {
+                    std::cerr << "[warning]: Failed to write the autotune cache "
+                              << cache_file << "\n";
+                }
+            }
+        }
+        icet_backend->set_single_image_strategy(strategies[best]);
         if (mpi_rank == 0) {
-            std::cout << "Frame " << i << " took " << render_time << "ms\n";
+            std::cout << "IceT Autotuned Strategy for " << setup << ": " << strategies[best]
+                      << "\n";
+        }
+    }
+#endif
 
-            if (save_images) {
-                std::string fname = prefix + "osp-icet-";
-                std::sprintf(&fmt_out_buf[0], fmt_string.c_str(), static_cast<int>(i));
-                fname += fmt_out_buf + ".jpg";
+    // When pipelining, the next frame is always queued before finishing the current one
+    // so its local rendering can start while the current one is composited
+    const auto frames_start = high_resolution_clock::now();
+    if (pipeline_frames && !camera_set.empty()) {
+        backend->queue_frame(make_camera(0), world, camera_set[0], brick_culled(0));
+    }
 
+    // Consecutive views sharing a composite order are batched as the layers of one frame,
+    // which is saved as an image per view or a single PPM of the layers with MPI-IO
+    size_t next_view = 0;
+    while (batch_views > 1 && next_view < camera_set.size()) {
+        const size_t first_view = next_view;
+        const std::vector<int> batch_order =
+            compute_composite_order(volume_tree, brick_placement, camera_set[first_view].pos);
+        std::vector<cpp::Camera> cameras;
+        bool culled = true;
+        while (next_view < camera_set.size() && cameras.size() < size_t(batch_views) &&
+               compute_composite_order(
+                   volume_tree, brick_placement, camera_set[next_view].pos) == batch_order) {
+            cameras.push_back(make_camera(next_view));
+            culled = culled && brick_culled(next_view);
+            ++next_view;
+        }
+        const size_t render_time =
+            backend->render_layers(cameras, world, camera_set[first_view], culled);
+        if (mpi_rank == 0) {
+            std::cout << "Frames " << first_view << "-" << next_view - 1 << " batched took "
+                      << render_time << "ms\n";
+        }
+        if (save_images && mpi_io_output) {
+            backend->write_frame(frame_file_name(first_view) + "-batch.ppm");
+        } else if (save_images && mpi_rank == 0) {
+            const uint32_t *img = backend->map_fb();
+            for (size_t i = 0; i < cameras.size(); ++i) {
+                stbi_write_jpg((frame_file_name(first_view + i) + ".jpg").c_str(),
+                               img_size.x,
+                               img_size.y,
+                               4,
+                               img + i * img_size.long_product(),
+                               90);
+            }
+            backend->unmap_fb(img);
+        }
+    }
+    for (size_t i = next_view; i < camera_set.size(); ++i) {
+        size_t render_time = 0;
+        size_t preview_time = 0;
+        if (pipeline_frames) {
+            if (i + 1 < camera_set.size()) {
+                backend->queue_frame(make_camera(i + 1),
+                                     world,
+                                     camera_set[i + 1],
+                                     brick_culled(i + 1));
+            }
+            render_time = backend->finish_frame();
+        } else {
+            if (preview_backend) {
+                preview_time = preview_backend->render(
+                    make_camera(i), world, camera_set[i], brick_culled(i));
+            }
+            render_time =
+                backend->render(make_camera(i), world, camera_set[i], brick_culled(i));
+        }
+        if (mpi_rank == 0) {
+            if (preview_backend) {
+                std::cout << "Frame " << i << " time to first image: " << preview_time
+                          << "ms, time to final image: " << preview_time + render_time
+                          << "ms\n";
+            } else {
+                std::cout << "Frame " << i << " took " << render_time << "ms\n";
+            }
+        }
+        total_preview_time += preview_time;
+        total_final_time += preview_time + render_time;
+        if (save_images) {
+            const std::string fname = frame_file_name(i);
+
+            if (preview_backend && mpi_io_output) {
+                preview_backend->write_frame(fname + "-preview.ppm");
+            } else if (preview_backend && mpi_rank == 0) {
+                const vec2i preview_size = preview_backend->img_size;
+                const uint32_t *img = preview_backend->map_fb();
+                stbi_write_jpg((fname + "-preview.jpg").c_str(),
+                               preview_size.x,
+                               preview_size.y,
+                               4,
+                               img,
+                               90);
+                preview_backend->unmap_fb(img);
+            }
+            // Each display rank saves its tile of the wall
+            if (!display_wall.empty()) {
+                const int tile_id = display_wall.rank_tile(mpi_rank);
+                if (tile_id != -1) {
+                    const vec2i tile_dims = display_wall.tiles[tile_id].size();
+                    const uint32_t *img = backend->map_fb();
+                    stbi_write_jpg(
+                        (fname + "-tile" + std::to_string(tile_id) + ".jpg").c_str(),
+                        tile_dims.x,
+                        tile_dims.y,
+                        4,
+                        img,
+                        90);
+                    backend->unmap_fb(img);
+                }
+            } else if (mpi_io_output) {
+                const auto write_start = high_resolution_clock::now();
+                backend->write_frame(fname + ".ppm");
+                const auto write_end = high_resolution_clock::now();
+                if (mpi_rank == 0) {
+                    std::cout << "Writing frame " << i << " took "
+                              << duration_cast<milliseconds>(write_end - write_start).count()
+                              << "ms\n";
+                }
+            } else if (mpi_rank == 0) {
                 const uint32_t *img = backend->map_fb();
-                stbi_write_jpg(fname.c_str(), img_size.x, img_size.y, 4, img, 90);
+                stbi_write_jpg(
+                    (fname + ".jpg").c_str(), img_size.x, img_size.y, 4, img, 90);
                 backend->unmap_fb(img);
             }
         }
+
+        if (rebalance_interval > 0) {
+            interval_render_time += backend->local_render_time;
+            if (preview_backend) {
+                interval_render_time += preview_backend->local_render_time;
+            }
+            ++interval_frames;
+            if (interval_frames < rebalance_interval && i + 1 < camera_set.size()) {
+                continue;
+            }
+            std::vector<double> rank_times(mpi_size, 0.0);
+            MPI_Allgather(&interval_render_time,
+                          1,
+                          MPI_DOUBLE,
+                          rank_times.data(),
+                          1,
+                          MPI_DOUBLE,
+                          MPI_COMM_WORLD);
+            const double avg_time =
+                std::accumulate(rank_times.begin(), rank_times.end(), 0.0) / mpi_size;
+            const double max_time = *std::max_element(rank_times.begin(), rank_times.end());
+            final_imbalance = avg_time > 0.0 ? max_time / avg_time : 1.0;
+            if (initial_imbalance < 0.0) {
+                initial_imbalance = final_imbalance;
+            }
+            if (mpi_rank == 0) {
+                std::cout << "Render Imbalance (max/avg) over frames "
+                          << i + 1 - size_t(interval_frames) << "-" << i << ": "
+                          << final_imbalance << "\n";
+            }
+            interval_render_time = 0.0;
+            interval_frames = 0;
+            if (i + 1 == camera_set.size() || avg_time == 0.0) {
+                continue;
+            }
+
+            // Each brick's cost is its share of its rank's render time, with a floor so
+            // the bricks of culled ranks don't grow without bound
+            const auto rebalance_start = high_resolution_clock::now();
+            std::vector<double> brick_costs(volume_tree.bricks.size(), 0.0);
+            for (size_t b = 0; b < brick_costs.size(); ++b) {
+                const int owner = brick_placement.brick_owners[b];
+                brick_costs[b] = std::max(rank_times[owner], 0.01 * avg_time) /
+                                 brick_placement.rank_bricks[owner].size();
+            }
+            const KdTree balanced_tree(volume_tree, brick_costs);
+            bricks = migrate_bricks(
+                config, bricks, volume_tree, balanced_tree, brick_placement, mpi_rank);
+            volume_tree = balanced_tree;
+            backend->set_volume_tree(volume_tree);
+            if (preview_backend) {
+                preview_backend->set_volume_tree(volume_tree);
+            }
+            world = make_world();
+            const auto rebalance_end = high_resolution_clock::now();
+            if (mpi_rank == 0) {
+                const auto rebalance_time = rebalance_end - rebalance_start;
+                std::cout << "Rebalancing bricks took "
+                          << duration_cast<milliseconds>(rebalance_time).count() << "ms\n";
+            }
+        }
     }
+    const double frames_time =
+        duration_cast<duration<double>>(high_resolution_clock::now() - frames_start).count();
     if (mpi_rank == 0) {
-        std::cout << "Rendering completed\n";
+        std::cout << "Rendering completed\n"
+                  << "Rendered " << camera_set.size() << " frames in " << frames_time * 1000.0
+                  << "ms, " << camera_set.size() / frames_time << " frames/sec\n";
+        if (!display_wall.empty()) {
+            const double megapixels = img_size.long_product() * 1e-6;
+            std::cout << "Display Wall: " << display_wall.tiles.size() << " tiles, "
+                      << megapixels << " megapixels per frame, "
+                      << megapixels * camera_set.size() / frames_time
+                      << " megapixels/sec\n";
+        }
+        if (preview_backend) {
+            std::cout << "Average time to first image: "
+                      << double(total_preview_time) / camera_set.size()
+                      << "ms, average time to final image: "
+                      << double(total_final_time) / camera_set.size() << "ms\n";
+        }
+        if (rebalance_interval > 0) {
+            std::cout << "Render Imbalance (max/avg) before rebalancing: " << initial_imbalance
+                      << ", after rebalancing: " << final_imbalance << "\n";
+        }
     }
     MPI_Barrier(MPI_COMM_WORLD);
 }
@@ -0,0 +1,323 @@
+#include "pixel_format.h"
+#include <array>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+#include <tbb/parallel_for.h>
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __AVX__
+#include <immintrin.h>
+#endif
+#if defined(__AVX__) && defined(__F16C__)
+#define PIXEL_FORMAT_F16C 1
+#endif
+
+std::string pixel_format_name(const PixelFormat format)
+{
+    switch (format) {
+    case PixelFormat::RGBA8:
+        return "rgba8";
+    case PixelFormat::RGBA16F:
+        return "rgba16f";
+    case PixelFormat::RGBA32F:
+        return "rgba32f";
+    }
+    return "unknown";
+}
+
+PixelFormat parse_pixel_format(const std::string &name)
+{
+    if (name == "rgba8") {
+        return PixelFormat::RGBA8;
+    } else if (name == "rgba16f") {
+        return PixelFormat::RGBA16F;
+    } else if (name == "rgba32f") {
+        return PixelFormat::RGBA32F;
+    }
+    throw std::runtime_error("Unknown pixel format '" + name +
+                             "', expected rgba8, rgba16f or rgba32f");
+}
+
+float half_to_float(const uint16_t h)
+{
+#ifdef PIXEL_FORMAT_F16C
+    return _cvtsh_ss(h);
+#else
+    const uint32_t sign = uint32_t(h & 0x8000) << 16;
+    const uint32_t exponent = (h >> 10) & 0x1f;
+    const uint32_t mantissa = h & 0x3ff;
+    if (exponent == 0) {
+        // Zero or denormal
+        const float f = std::ldexp(float(mantissa), -24);
+        return sign ? -f : f;
+    }
+    uint32_t bits = 0;
+    if (exponent == 31) {
+        bits = sign | 0x7f800000 | (mantissa << 13);
+    } else {
+        bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+    }
+    float f = 0.f;
+    std::memcpy(&f, &bits, sizeof(float));
+    return f;
+#endif
+}
+
+uint16_t float_to_half(const float f)
+{
+#ifdef PIXEL_FORMAT_F16C
+    return _cvtss_sh(f, _MM_FROUND_TO_NEAREST_INT);
+#else
+    uint32_t bits = 0;
+    std::memcpy(&bits, &f, sizeof(float));
+    const uint32_t sign = (bits >> 16) & 0x8000;
+    const int exponent = int((bits >> 23) & 0xff) - 127 + 15;
+    uint32_t mantissa = bits & 0x7fffff;
+
+    if (((bits >> 23) & 0xff) == 0xff) {
+        // Inf or NaN
+        return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+    }
+    if (exponent >= 31) {
+        return sign | 0x7c00;
+    }
+    if (exponent <= 0) {
+        // Denormal or too small to represent
+        if (exponent < -10) {
+            return sign;
+        }
+        mantissa |= 0x800000;
+        const uint32_t shift = 14 - exponent;
+        uint32_t h = mantissa >> shift;
+        const uint32_t remainder = mantissa & ((1u << shift) - 1);
+        const uint32_t halfway = 1u << (shift - 1);
+        if (remainder > halfway || (remainder == halfway && (h & 1))) {
+            ++h;
+        }
+        return sign | h;
+    }
+    // Round to nearest even, a carry out of the mantissa correctly bumps the exponent
+    uint32_t h = (uint32_t(exponent) << 10) | (mantissa >> 13);
+    const uint32_t remainder = mantissa & 0x1fff;
+    if (remainder > 0x1000 || (remainder == 0x1000 && (h & 1))) {
+        ++h;
+    }
+    return sign | h;
+#endif
+}
+
+// Run the kernel over blocks of the n pixels in parallel
+template <typename F>
+static void parallel_spans(const size_t n, const F &kernel)
+{
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, n),
+                      [&](const tbb::blocked_range<size_t> &r) {
+                          kernel(r.begin(), r.end() - r.begin());
+                      });
+}
+
+#ifdef __SSE2__
+/* Blend two RGBA8 pixels with their channels widened to 16 bits, matching
+ * blend_over exactly. The division by 255 is done as (x + 1 + (x >> 8)) >> 8, which
+ * is exact for the range of back * transmission + 127
+ */
+static inline __m128i blend_over_epi16(const __m128i front, const __m128i back)
+{
+    const __m128i alpha = _mm_shufflehi_epi16(
+        _mm_shufflelo_epi16(front, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+    const __m128i transmission = _mm_sub_epi16(_mm_set1_epi16(255), alpha);
+    const __m128i x =
+        _mm_add_epi16(_mm_mullo_epi16(back, transmission), _mm_set1_epi16(127));
+    return _mm_srli_epi16(
+        _mm_add_epi16(_mm_add_epi16(x, _mm_set1_epi16(1)), _mm_srli_epi16(x, 8)), 8);
+}
+#endif
+
+void blend_span(const uint32_t *front, const uint32_t *back, uint32_t *out, size_t n)
+{
+    size_t i = 0;
+#ifdef __SSE2__
+    // Blend four pixels at a time, adding the front pixels with saturation
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 4 <= n; i += 4) {
+        const __m128i f = _mm_loadu_si128(reinterpret_cast<const __m128i *>(front + i));
+        const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(back + i));
+        const __m128i lo = blend_over_epi16(_mm_unpacklo_epi8(f, zero),
+                                            _mm_unpacklo_epi8(b, zero));
+        const __m128i hi = blend_over_epi16(_mm_unpackhi_epi8(f, zero),
+                                            _mm_unpackhi_epi8(b, zero));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i),
+                         _mm_adds_epu8(f, _mm_packus_epi16(lo, hi)));
+    }
+#endif
+    for (; i < n; ++i) {
+        out[i] = blend_over(front[i], back[i]);
+    }
+}
+
+void blend_span(const RGBA16F *front, const RGBA16F *back, RGBA16F *out, size_t n)
+{
+    size_t i = 0;
+#ifdef PIXEL_FORMAT_F16C
+    // Blend two pixels at a time, each 128 bit lane holds one pixel
+    const __m256 one = _mm256_set1_ps(1.f);
+    for (; i + 2 <= n; i += 2) {
+        const __m256 f = _mm256_cvtph_ps(
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(front + i)));
+        const __m256 b =
+            _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i *>(back + i)));
+        const __m256 transmission =
+            _mm256_sub_ps(one, _mm256_permute_ps(f, _MM_SHUFFLE(3, 3, 3, 3)));
+        const __m256 result = _mm256_add_ps(f, _mm256_mul_ps(b, transmission));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i),
+                         _mm256_cvtps_ph(result, _MM_FROUND_TO_NEAREST_INT));
+    }
+#endif
+    for (; i < n; ++i) {
+        out[i] = make_pixel<RGBA16F>(
+            blend_over(pixel_channels(front[i]), pixel_channels(back[i])));
+    }
+}
+
+void blend_span(const vec4f *front, const vec4f *back, vec4f *out, size_t n)
+{
+    size_t i = 0;
+#ifdef __AVX__
+    // Blend two pixels at a time, each 128 bit lane holds one pixel
+    const __m256 one8 = _mm256_set1_ps(1.f);
+    for (; i + 2 <= n; i += 2) {
+        const __m256 f = _mm256_loadu_ps(&front[i].x);
+        const __m256 b = _mm256_loadu_ps(&back[i].x);
+        const __m256 transmission =
+            _mm256_sub_ps(one8, _mm256_permute_ps(f, _MM_SHUFFLE(3, 3, 3, 3)));
+        _mm256_storeu_ps(&out[i].x, _mm256_add_ps(f, _mm256_mul_ps(b, transmission)));
+    }
+#endif
+#ifdef __SSE__
+    const __m128 one = _mm_set1_ps(1.f);
+    for (; i < n; ++i) {
+        const __m128 f = _mm_loadu_ps(&front[i].x);
+        const __m128 b = _mm_loadu_ps(&back[i].x);
+        const __m128 transmission =
+            _mm_sub_ps(one, _mm_shuffle_ps(f, f, _MM_SHUFFLE(3, 3, 3, 3)));
+        _mm_storeu_ps(&out[i].x, _mm_add_ps(f, _mm_mul_ps(b, transmission)));
+    }
+#else
+    for (; i < n; ++i) {
+        out[i] = blend_over(front[i], back[i]);
+    }
+#endif
+}
+
+template <typename Pixel>
+void blend_images(const Pixel *front, const Pixel *back, Pixel *out, size_t n)
+{
+    parallel_spans(n, [&](const size_t begin, const size_t count) {
+        blend_span(front + begin, back + begin, out + begin, count);
+    });
+}
+
+template void blend_images(const uint32_t *, const uint32_t *, uint32_t *, size_t);
+template void blend_images(const RGBA16F *, const RGBA16F *, RGBA16F *, size_t);
+template void blend_images(const vec4f *, const vec4f *, vec4f *, size_t);
+
+void convert_pixels(const vec4f *in, RGBA16F *out, size_t n)
+{
+    parallel_spans(n, [&](const size_t begin, const size_t count) {
+        size_t i = begin;
+#ifdef PIXEL_FORMAT_F16C
+        for (; i + 2 <= begin + count; i += 2) {
+            _mm_storeu_si128(
+                reinterpret_cast<__m128i *>(out + i),
+                _mm256_cvtps_ph(_mm256_loadu_ps(&in[i].x), _MM_FROUND_TO_NEAREST_INT));
+        }
+#endif
+        for (; i < begin + count; ++i) {
+            out[i] = make_pixel<RGBA16F>(in[i]);
+        }
+    });
+}
+
+void convert_pixels(const RGBA16F *in, vec4f *out, size_t n)
+{
+    parallel_spans(n, [&](const size_t begin, const size_t count) {
+        size_t i = begin;
+#ifdef PIXEL_FORMAT_F16C
+        for (; i + 2 <= begin + count; i += 2) {
+            _mm256_storeu_ps(
+                &out[i].x,
+                _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i *>(in + i))));
+        }
+#endif
+        for (; i < begin + count; ++i) {
+            out[i] = pixel_channels(in[i]);
+        }
+    });
+}
+
+float srgb_to_linear(const float x)
+{
+    return x <= 0.04045f ? x / 12.92f : std::pow((x + 0.055f) / 1.055f, 2.4f);
+}
+
+// Table of the 8 bit sRGB encoding of linear values quantized to 12 bits
+static const size_t SRGB_TABLE_SIZE = 4096;
+
+static const std::array<uint8_t, SRGB_TABLE_SIZE> &linear_to_srgb_table()
+{
+    static const std::array<uint8_t, SRGB_TABLE_SIZE> table = [] {
+        std::array<uint8_t, SRGB_TABLE_SIZE> t;
+        for (size_t i = 0; i < t.size(); ++i) {
+            const float x = float(i) / (t.size() - 1);
+            const float s =
+                x <= 0.0031308f ? 12.92f * x : 1.055f * std::pow(x, 1.f / 2.4f) - 0.055f;
+            t[i] = uint8_t(std::round(s * 255.f));
+        }
+        return t;
+    }();
+    return table;
+}
+
+static const std::array<float, 256> &srgb_to_linear_table()
+{
+    static const std::array<float, 256> table = [] {
+        std::array<float, 256> t;
+        for (size_t i = 0; i < t.size(); ++i) {
+            t[i] = srgb_to_linear(i / 255.f);
+        }
+        return t;
+    }();
+    return table;
+}
+
+void convert_pixels(const vec4f *in, uint32_t *out, size_t n)
+{
+    const auto &table = linear_to_srgb_table();
+    parallel_spans(n, [&](const size_t begin, const size_t count) {
+        for (size_t i = begin; i < begin + count; ++i) {
+            const vec4f p = min(max(in[i], vec4f(0.f)), vec4f(1.f));
+            out[i] = uint32_t(table[size_t(p.x * (SRGB_TABLE_SIZE - 1) + 0.5f)]) |
+                     (uint32_t(table[size_t(p.y * (SRGB_TABLE_SIZE - 1) + 0.5f)]) << 8) |
+                     (uint32_t(table[size_t(p.z * (SRGB_TABLE_SIZE - 1) + 0.5f)]) << 16) |
+                     (uint32_t(p.w * 255.f + 0.5f) << 24);
+        }
+    });
+}
+
+void convert_pixels(const uint32_t *in, vec4f *out, size_t n)
+{
+    const auto &table = srgb_to_linear_table();
+    parallel_spans(n, [&](const size_t begin, const size_t count) {
+        for (size_t i = begin; i < begin + count; ++i) {
+            out[i] = vec4f(table[in[i] & 0xff],
+                           table[(in[i] >> 8) & 0xff],
+                           table[(in[i] >> 16) & 0xff],
+                           (in[i] >> 24) / 255.f);
+        }
+    });
+}
@@ -0,0 +1,146 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <rkcommon/math/vec.h>
+
+using namespace rkcommon::math;
+
+/* The pixel formats the native compositors can exchange and blend the partial
+ * images in, all of which store premultiplied RGBA. RGBA8 is the sRGB image
+ * rendered by OSPRay, the float formats hold linear color.
+ */
+enum class PixelFormat { RGBA8, RGBA16F, RGBA32F };
+
+std::string pixel_format_name(const PixelFormat format);
+
+// Parse the pixel format name, throws if it is not one of the formats
+PixelFormat parse_pixel_format(const std::string &name);
+
+// A premultiplied RGBA pixel with IEEE half-precision channels
+struct RGBA16F {
+    uint16_t r, g, b, a;
+};
+
+// The number of 32 bit words in a pixel, pixels are sent over MPI as words
+template <typename Pixel>
+constexpr size_t pixel_words()
+{
+    return sizeof(Pixel) / sizeof(uint32_t);
+}
+
+// Empty pixels are fully zero and are skipped by the run-length encoding
+inline bool pixel_empty(const uint32_t pixel)
+{
+    return pixel == 0;
+}
+
+inline bool pixel_empty(const RGBA16F &pixel)
+{
+    return (pixel.r | pixel.g | pixel.b | pixel.a) == 0;
+}
+
+inline bool pixel_empty(const vec4f &pixel)
+{
+    return pixel.x == 0.f && pixel.y == 0.f && pixel.z == 0.f && pixel.w == 0.f;
+}
+
+// Convert between float and the bits of a half-precision float
+float half_to_float(const uint16_t h);
+
+uint16_t float_to_half(const float f);
+
+// The channels of the pixel as floats, with the RGBA8 channels mapped to [0, 1]
+inline vec4f pixel_channels(const uint32_t pixel)
+{
+    return vec4f(pixel & 0xff, (pixel >> 8) & 0xff, (pixel >> 16) & 0xff, pixel >> 24) /
+           255.f;
+}
+
+inline vec4f pixel_channels(const RGBA16F &pixel)
+{
+    return vec4f(half_to_float(pixel.r),
+                 half_to_float(pixel.g),
+                 half_to_float(pixel.b),
+                 half_to_float(pixel.a));
+}
+
+inline vec4f pixel_channels(const vec4f &pixel)
+{
+    return pixel;
+}
+
+// Make a pixel from its channels, the inverse of pixel_channels
+template <typename Pixel>
+Pixel make_pixel(const vec4f &channels);
+
+template <>
+inline uint32_t make_pixel(const vec4f &channels)
+{
+    const vec4f c = min(max(channels, vec4f(0.f)), vec4f(1.f)) * 255.f + 0.5f;
+    return uint32_t(c.x) | (uint32_t(c.y) << 8) | (uint32_t(c.z) << 16) |
+           (uint32_t(c.w) << 24);
+}
+
+template <>
+inline RGBA16F make_pixel(const vec4f &channels)
+{
+    return RGBA16F{float_to_half(channels.x),
+                   float_to_half(channels.y),
+                   float_to_half(channels.z),
+                   float_to_half(channels.w)};
+}
+
+template <>
+inline vec4f make_pixel(const vec4f &channels)
+{
+    return channels;
+}
+
+// Convert an sRGB encoded color value to linear
+float srgb_to_linear(const float x);
+
+// Blend two premultiplied RGBA8 pixels with front over back
+inline uint32_t blend_over(const uint32_t front, const uint32_t back)
+{
+    const uint32_t transmission = 255 - (front >> 24);
+    uint32_t result = 0;
+    for (uint32_t c = 0; c < 32; c += 8) {
+        const uint32_t f = (front >> c) & 0xff;
+        const uint32_t b = (back >> c) & 0xff;
+        result |= std::min(f + (b * transmission + 127) / 255, 255u) << c;
+    }
+    return result;
+}
+
+inline vec4f blend_over(const vec4f &front, const vec4f &back)
+{
+    return front + back * (1.f - front.w);
+}
+
+/* Blend the back pixels under the front ones, writing the result to out. out may
+ * be front or back, to accumulate front-to-back or back-to-front respectively. The
+ * RGBA8 kernel uses SSE2, fp16 AVX/F16C and fp32 AVX or SSE when available, with
+ * scalar fallbacks. blend_span runs on the calling thread, blend_images splits the
+ * pixels over the TBB threads
+ */
+void blend_span(const uint32_t *front, const uint32_t *back, uint32_t *out, size_t n);
+
+void blend_span(const RGBA16F *front, const RGBA16F *back, RGBA16F *out, size_t n);
+
+void blend_span(const vec4f *front, const vec4f *back, vec4f *out, size_t n);
+
+template <typename Pixel>
+void blend_images(const Pixel *front, const Pixel *back, Pixel *out, size_t n);
+
+// Convert the linear premultiplied float pixels to fp16
+void convert_pixels(const vec4f *in, RGBA16F *out, size_t n);
+
+void convert_pixels(const RGBA16F *in, vec4f *out, size_t n);
+
+// Convert the linear float pixels to RGBA8 with sRGB encoded color, as OSP_FB_SRGBA does
+void convert_pixels(const vec4f *in, uint32_t *out, size_t n);
+
+// Convert the RGBA8 pixels with sRGB encoded color to linear float
+void convert_pixels(const uint32_t *in, vec4f *out, size_t n);
@@ -19,31 +19,34 @@ class BenchmarkRun:
         self.compositing_overhead = []
         self.frame_times = []
 
+compositor_labels = {
+    "dfb": "DFB",
+    "icet": "IceT",
+    "bswap": "Binary Swap",
+    "radixk": "Radix-k",
+    "twothree": "2-3 Swap",
+    "directsend": "Direct-Send",
+}
+
 class ScalingRun:
     def __init__(self, res):
         self.resolution = res
-        self.icet = []
-        self.dfb = []
+        self.runs = {}
 
     def add_run(self, run):
-        if run.compositor == "icet":
-            self.icet.append(run)
-        elif run.compositor == "dfb":
-            self.dfb.append(run)
+        if not run.compositor in self.runs:
+            self.runs[run.compositor] = []
+        self.runs[run.compositor].append(run)
 
     def sort(self):
-        self.icet.sort(key=lambda r: r.node_count)
-        self.dfb.sort(key=lambda r: r.node_count)
+        for c, runs in self.runs.items():
+            runs.sort(key=lambda r: r.node_count)
 
     def get_results(self, compositor, var):
         x = []
         y = []
         yerr = []
-        data = self.dfb
-        if compositor == "icet":
-            data = self.icet
-
-        for run in data:
+        for run in self.runs[compositor]:
             x.append(run.node_count)
             if var == "total":
                 y.append(np.mean(run.frame_times[10:]))
@@ -129,25 +132,16 @@ colors = cm.get_cmap("tab20c", 20)
 next_color = 0
 
 for img_str, sr in scaling_runs.items():
-    dfb_label = "DFB {}".format(img_str)
-    icet_label = "IceT {}".format(img_str)
-
-    dfb_color = colors(next_color)
-    next_color = next_color + 1.0 / 5.0
-    icet_color = colors(next_color)
-    next_color = next_color + 1.0 / 5.0
-
-    x, y, yerr = sr.get_results("dfb", plot_var)
-    if not show_error:
-        plt.plot(x, y, label=dfb_label, linewidth=2, color=dfb_color)
-    else:
-        plt.errorbar(x, y, yerr=yerr, label=dfb_label, linewidth=2, color=dfb_color)
-
-    x, y, yerr = sr.get_results("icet", plot_var)
-    if not show_error:
-        plt.plot(x, y, label=icet_label, linewidth=2, color=icet_color)
-    else:
-        plt.errorbar(x, y, yerr=yerr, label=icet_label, linewidth=2, color=icet_color)
+    for compositor in sorted(sr.runs.keys()):
+        label = "{} {}".format(compositor_labels.get(compositor, compositor), img_str)
+        color = colors(next_color)
+        next_color = next_color + 1.0 / 5.0
+
+        x, y, yerr = sr.get_results(compositor, plot_var)
+        if not show_error:
+            plt.plot(x, y, label=label, linewidth=2, color=color)
+        else:
+            plt.errorbar(x, y, yerr=yerr, label=label, linewidth=2, color=color)
 
 plt.title(args["<title>"])
 plt.legend()
@@ -1,18 +1,72 @@
 #include "render_backend.h"
+#include <algorithm>
 #include <array>
 #include <chrono>
+#include <cmath>
+#include <iterator>
 #include <limits>
+#include <numeric>
 #include <vector>
 #if ICET_ENABLED
 #include <IceT.h>
 #include <IceTMPI.h>
 #endif
 #include <mpi.h>
+#include <tbb/parallel_for.h>
 #include "loader.h"
 #include "profiling.h"
 #include "stb_image_write.h"
 #include "util.h"
 
+DisplayWall::DisplayWall(const vec2i &img_size,
+                         const vec2i &grid,
+                         const std::vector<int> &ranks,
+                         const int num_ranks)
+    : display_ranks(ranks)
+{
+    if (grid.x < 1 || grid.y < 1 || grid.x > img_size.x || grid.y > img_size.y) {
+        throw std::runtime_error("Invalid display wall tile grid");
+    }
+    const size_t n_tiles = grid.long_product();
+    // By default the tiles are shown by the first ranks
+    if (display_ranks.empty()) {
+        for (size_t i = 0; i < n_tiles; ++i) {
+            display_ranks.push_back(i);
+        }
+    }
+    if (display_ranks.size() != n_tiles) {
+        throw std::runtime_error("A display rank must be given for each display wall tile");
+    }
+    std::vector<bool> displaying(num_ranks, false);
+    for (const auto &r : display_ranks) {
+        if (r < 0 || r >= num_ranks || displaying[r]) {
+            throw std::runtime_error("Display wall tiles must be shown by distinct ranks");
+        }
+        displaying[r] = true;
+    }
+
+    for (int y = 0; y < grid.y; ++y) {
+        for (int x = 0; x < grid.x; ++x) {
+            tiles.push_back(box2i(vec2i(x, y) * img_size / grid,
+                                  vec2i(x + 1, y + 1) * img_size / grid));
+        }
+    }
+}
+
+bool DisplayWall::empty() const
+{
+    return tiles.empty();
+}
+
+int DisplayWall::rank_tile(const int rank) const
+{
+    auto fnd = std::find(display_ranks.begin(), display_ranks.end(), rank);
+    if (fnd == display_ranks.end()) {
+        return -1;
+    }
+    return std::distance(display_ranks.begin(), fnd);
+}
+
 RenderBackend::RenderBackend(const vec2i &size, bool detailed_cpu_stats, const vec3f &bg_color)
     : img_size(size),
       fb(size.x, size.y, OSP_FB_SRGBA, OSP_FB_COLOR | OSP_FB_DEPTH),
@@ -26,6 +80,164 @@ RenderBackend::RenderBackend(const vec2i &size, bool detailed_cpu_stats, const v
     MPI_Comm_size(MPI_COMM_WORLD, &mpi_size);
 }
 
+void RenderBackend::queue_frame(const cpp::Camera &camera,
+                                const cpp::World &world,
+                                const Camera &view,
+                                const bool culled)
+{
+    QueuedFrame frame;
+    frame.camera = camera;
+    frame.world = world;
+    frame.view = view;
+    frame.culled = culled;
+    queued_frames.push_back(frame);
+}
+
+size_t RenderBackend::finish_frame()
+{
+    const QueuedFrame frame = queued_frames.front();
+    queued_frames.pop_front();
+    return render(frame.camera, frame.world, frame.view, frame.culled);
+}
+
+bool RenderBackend::pipelines_frames() const
+{
+    return false;
+}
+
+size_t RenderBackend::render_layers(const std::vector<cpp::Camera> &,
+                                    const cpp::World &,
+                                    const Camera &,
+                                    const bool)
+{
+    throw std::runtime_error("Rendering batched views is not supported by this backend");
+}
+
+void RenderBackend::set_volume_tree(const KdTree &) {}
+
+bool RenderBackend::set_display_wall(const DisplayWall &)
+{
+    return false;
+}
+
+void RenderBackend::write_frame(const std::string &fname)
+{
+    std::vector<box2i> regions;
+    const uint32_t *img = nullptr;
+    if (mpi_rank == 0) {
+        img = map_fb();
+        regions.push_back(box2i(vec2i(0), img_size));
+    }
+    write_ppm(fname, regions, img);
+    if (mpi_rank == 0) {
+        unmap_fb(img);
+    }
+}
+
+void RenderBackend::write_ppm(const std::string &fname,
+                              const std::vector<box2i> &regions,
+                              const uint32_t *pixels) const
+{
+    const std::string header =
+        "P6\n" + std::to_string(img_size.x) + " " + std::to_string(img_size.y) + "\n255\n";
+
+    // Each row of a region is a run of RGB bytes in the file, with the framebuffer's
+    // rows going bottom to top while the PPM's go top to bottom. The runs are sorted
+    // by their file offset as required for the file view, merging adjacent runs
+    struct PixelRun {
+        size_t file_offset;
+        size_t pixel_offset;
+        size_t length;
+    };
+    std::vector<PixelRun> runs;
+    size_t n_pixels = 0;
+    for (const auto &r : regions) {
+        const size_t width = r.upper.x - r.lower.x;
+        for (int y = r.lower.y; y < r.upper.y; ++y) {
+            const size_t row = img_size.y - 1 - y;
+            runs.push_back(PixelRun{row * img_size.x + r.lower.x, n_pixels, width});
+            n_pixels += width;
+        }
+    }
+    std::sort(runs.begin(), runs.end(), [](const PixelRun &a, const PixelRun &b) {
+        return a.file_offset < b.file_offset;
+    });
+
+    std::vector<uint8_t> rgb(n_pixels * 3, 0);
+    std::vector<int> lengths;
+    std::vector<MPI_Aint> displacements;
+    size_t out = 0;
+    for (const auto &run : runs) {
+        for (size_t i = 0; i < run.length; ++i, ++out) {
+            const uint32_t p = pixels[run.pixel_offset + i];
+            rgb[out * 3] = p & 0xff;
+            rgb[out * 3 + 1] = (p >> 8) & 0xff;
+            rgb[out * 3 + 2] = (p >> 16) & 0xff;
+        }
+        if (!displacements.empty() &&
+            size_t(displacements.back() + lengths.back()) == run.file_offset * 3) {
+            lengths.back() += run.length * 3;
+        } else {
+            displacements.push_back(run.file_offset * 3);
+            lengths.push_back(run.length * 3);
+        }
+    }
+
+    MPI_File file_handle;
+    int rc = MPI_File_open(MPI_COMM_WORLD,
+                           fname.c_str(),
+                           MPI_MODE_WRONLY | MPI_MODE_CREATE,
+                           MPI_INFO_NULL,
+                           &file_handle);
+    if (rc != MPI_SUCCESS) {
+        std::cerr << "[error]: Failed to open file " << fname
+                  << ". MPI Error: " << get_mpi_error(rc) << "\n";
+        throw std::runtime_error("Failed to open " + fname);
+    }
+    // Truncate any existing larger file, it's all overwritten
+    MPI_File_set_size(file_handle, header.size() + img_size.long_product() * 3);
+    if (mpi_rank == 0) {
+        MPI_File_write_at(file_handle,
+                          0,
+                          header.data(),
+                          header.size(),
+                          MPI_CHAR,
+                          MPI_STATUS_IGNORE);
+    }
+
+    MPI_Datatype file_type;
+    MPI_Type_create_hindexed(
+        lengths.size(), lengths.data(), displacements.data(), MPI_BYTE, &file_type);
+    MPI_Type_commit(&file_type);
+    MPI_File_set_view(
+        file_handle, header.size(), MPI_BYTE, file_type, "native", MPI_INFO_NULL);
+    rc = MPI_File_write_at_all(
+        file_handle, 0, rgb.data(), rgb.size(), MPI_BYTE, MPI_STATUS_IGNORE);
+    if (rc != MPI_SUCCESS) {
+        std::cerr << "[error]: Failed to write image to file. MPI Error: "
+                  << get_mpi_error(rc) << "\n";
+        throw std::runtime_error("Failed to write image to " + fname);
+    }
+    MPI_Type_free(&file_type);
+    MPI_File_close(&file_handle);
+}
+
+std::vector<int> compute_composite_order(const KdTree &volume_tree,
+                                         const BrickPlacement &placement,
+                                         const vec3f &cam_pos)
+{
+    // Each rank's bricks are contiguous in the visibility order and rendered to a
+    // single image, so the rank takes the place of all its bricks
+    std::vector<int> process_order;
+    for (const auto &b : volume_tree.front_to_back(cam_pos)) {
+        const int rank = placement.brick_owners[b];
+        if (process_order.empty() || process_order.back() != rank) {
+            process_order.push_back(rank);
+        }
+    }
+    return process_order;
+}
+
 OSPRayDFBBackend::OSPRayDFBBackend(const vec2i &img_dims,
                                    bool detailed_cpu_stats,
                                    const vec3f &bg_color)
@@ -38,13 +250,21 @@ OSPRayDFBBackend::OSPRayDFBBackend(const vec2i &img_dims,
 
 size_t OSPRayDFBBackend::render(const cpp::Camera &camera,
                                 const cpp::World &world,
-                                const vec3f &cam_pos)
+                                const Camera &,
+                                const bool)
 {
+    // The distributed framebuffer already skips the regions which don't project to any
+    // tiles, and each rank must still render the tiles it owns
+
     using namespace std::chrono;
     ProfilingPoint start;
     auto future = fb.renderFrame(renderer, camera, world);
     future.wait();
     ProfilingPoint end;
+    // Rendering and compositing are interleaved in the DFB, so the whole frame is
+    // counted as rendering time
+    local_render_time =
+        duration_cast<duration<double, std::milli>>(end.time - start.time).count();
     if (report_cpu_stats) {
         std::cout << "rank " << mpi_rank << ", CPU: " << cpu_utilization(start, end) << "%\n";
         MPI_Barrier(MPI_COMM_WORLD);
@@ -62,22 +282,238 @@ void OSPRayDFBBackend::unmap_fb(const uint32_t *mapping)
     fb.unmap(const_cast<uint32_t *>(mapping));
 }
 
-#if ICET_ENABLED
-IceTBackend::BrickInfo::BrickInfo(const vec3i &pos, const vec3i &dims, int owner)
-    : pos(pos), dims(dims), owner(owner)
+// Point the perspective camera along the view of the whole image, the region of the image
+// it renders is left to the caller to set with imageStart and imageEnd
+static void set_camera_view(cpp::Camera &camera, const Camera &view, const vec2i &img_size)
+{
+    camera.setParam("aspect", static_cast<float>(img_size.x) / img_size.y);
+    camera.setParam("position", view.pos);
+    camera.setParam("direction", view.dir);
+    camera.setParam("up", view.up);
+}
+
+ImageParallelBackend::ImageParallelBackend(const vec2i &img_dims,
+                                           bool detailed_cpu_stats,
+                                           const vec3f &bg_color,
+                                           const int tile_size)
+    : RenderBackend(img_dims, detailed_cpu_stats, bg_color),
+      renderer("scivis"),
+      tile_camera("perspective"),
+      tile_size(tile_size),
+      n_tiles((img_dims.x + tile_size - 1) / tile_size,
+              (img_dims.y + tile_size - 1) / tile_size)
+{
+    renderer.setParam("volumeSamplingRate", 1.f);
+    renderer.setParam("bgColor", bg_color);
+    renderer.commit();
+
+    MPI_Win_allocate(
+        sizeof(int), sizeof(int), MPI_INFO_NULL, MPI_COMM_WORLD, &next_tile, &window);
+    MPI_Win_lock_all(0, window);
+    reset_tiles();
+
+    if (mpi_rank == 0) {
+        final_img.resize(img_dims.long_product(), 0);
+    }
+}
+
+ImageParallelBackend::~ImageParallelBackend()
+{
+    MPI_Win_unlock_all(window);
+    MPI_Win_free(&window);
+}
+
+size_t ImageParallelBackend::render(const cpp::Camera &,
+                                    const cpp::World &world,
+                                    const Camera &view,
+                                    const bool)
+{
+    using namespace std::chrono;
+    ProfilingPoint start;
+
+    // Wait for every rank to have reset its counter after the last frame
+    MPI_Barrier(MPI_COMM_WORLD);
+
+    rendered_ids.clear();
+    rendered_pixels.clear();
+    tiles_rendered = 0;
+    tiles_stolen = 0;
+    local_render_time = 0.0;
+
+    // Render our own tiles first, then steal from the other ranks starting with our
+    // neighbor, whose tiles are the next ones in the image
+    set_camera_view(tile_camera, view, img_size);
+    for (int i = 0; i < mpi_size; ++i) {
+        const int victim = (mpi_rank + i) % mpi_size;
+        for (int t = claim_tile(victim); t != -1; t = claim_tile(victim)) {
+            const box2i bounds = tile_bounds(t);
+            const vec2i size = bounds.size();
+            auto fb_it = tile_fbs.find(std::make_pair(size.x, size.y));
+            if (fb_it == tile_fbs.end()) {
+                cpp::FrameBuffer tile_fb(size.x, size.y, OSP_FB_SRGBA, OSP_FB_COLOR);
+                tile_fb.commit();
+                fb_it = tile_fbs.emplace(std::make_pair(size.x, size.y), tile_fb).first;
+            }
+
+            tile_camera.setParam("imageStart", vec2f(bounds.lower) / vec2f(img_size));
+            tile_camera.setParam("imageEnd", vec2f(bounds.upper) / vec2f(img_size));
+            tile_camera.commit();
+            const ProfilingPoint render_start;
+            fb_it->second.renderFrame(renderer, tile_camera, world).wait();
+            local_render_time += duration_cast<duration<double, std::milli>>(
+                                     ProfilingPoint().time - render_start.time)
+                                     .count();
+
+            const uint32_t *img =
+                static_cast<const uint32_t *>(fb_it->second.map(OSP_FB_COLOR));
+            rendered_ids.push_back(t);
+            rendered_pixels.insert(rendered_pixels.end(), img, img + size.long_product());
+            fb_it->second.unmap(const_cast<uint32_t *>(img));
+
+            ++tiles_rendered;
+            if (i > 0) {
+                ++tiles_stolen;
+            }
+        }
+    }
+
+    // Once no rank is still stealing tiles our counter can be reset for the next frame
+    MPI_Barrier(MPI_COMM_WORLD);
+    reset_tiles();
+    gather_tiles();
+    ProfilingPoint end;
+
+    int total_stolen = 0;
+    MPI_Reduce(&tiles_stolen, &total_stolen, 1, MPI_INT, MPI_SUM, 0, MPI_COMM_WORLD);
+    // Reduce the max of the negated count to get the min tiles rendered by a rank
+    const std::array<int, 2> local_counts = {tiles_rendered, -tiles_rendered};
+    std::array<int, 2> max_counts = {0, 0};
+    MPI_Reduce(
+        local_counts.data(), max_counts.data(), 2, MPI_INT, MPI_MAX, 0, MPI_COMM_WORLD);
+    if (mpi_rank == 0) {
+        std::cout << "ImageParallel Tiles Stolen: " << total_stolen << "\n"
+                  << "ImageParallel Tiles per Rank: " << -max_counts[1] << "-"
+                  << max_counts[0] << "\n";
+    }
+    if (report_cpu_stats) {
+        std::cout << "rank " << mpi_rank << ", CPU: " << cpu_utilization(start, end) << "%\n";
+        MPI_Barrier(MPI_COMM_WORLD);
+    }
+    return elapsed_time_ms(start, end);
+}
+
+const uint32_t *ImageParallelBackend::map_fb()
+{
+    return final_img.data();
+}
+
+void ImageParallelBackend::unmap_fb(const uint32_t *) {}
+
+vec2i ImageParallelBackend::rank_tiles(const int rank) const
+{
+    const int64_t total_tiles = n_tiles.long_product();
+    return vec2i(total_tiles * rank / mpi_size, total_tiles * (rank + 1) / mpi_size);
+}
+
+void ImageParallelBackend::reset_tiles()
+{
+    const int first_tile = rank_tiles(mpi_rank).x;
+    MPI_Accumulate(&first_tile, 1, MPI_INT, mpi_rank, 0, 1, MPI_INT, MPI_REPLACE, window);
+    MPI_Win_flush(mpi_rank, window);
+}
+
+int ImageParallelBackend::claim_tile(const int rank)
 {
+    const int one = 1;
+    int tile = 0;
+    MPI_Fetch_and_op(&one, &tile, MPI_INT, rank, 0, MPI_SUM, window);
+    MPI_Win_flush(rank, window);
+    return tile < rank_tiles(rank).y ? tile : -1;
+}
+
+box2i ImageParallelBackend::tile_bounds(const int tile_id) const
+{
+    const vec2i lower = vec2i(tile_id % n_tiles.x, tile_id / n_tiles.x) * tile_size;
+    return box2i(lower, min(lower + vec2i(tile_size), img_size));
+}
+
+void ImageParallelBackend::gather_tiles()
+{
+    const int n_rendered = rendered_ids.size();
+    std::vector<int> tile_counts(mpi_size, 0);
+    MPI_Gather(&n_rendered, 1, MPI_INT, tile_counts.data(), 1, MPI_INT, 0, MPI_COMM_WORLD);
+
+    std::vector<int> tile_offsets(mpi_size, 0);
+    std::vector<int> all_ids;
+    if (mpi_rank == 0) {
+        std::partial_sum(tile_counts.begin(), tile_counts.end() - 1, tile_offsets.begin() + 1);
+        all_ids.resize(n_tiles.long_product(), 0);
+    }
+    MPI_Gatherv(rendered_ids.data(),
+                n_rendered,
+                MPI_INT,
+                all_ids.data(),
+                tile_counts.data(),
+                tile_offsets.data(),
+                MPI_INT,
+                0,
+                MPI_COMM_WORLD);
+
+    // The tiles are received in the order each rank rendered them, and copied into
+    // their place in the final image after
+    std::vector<int> pixel_counts(mpi_size, 0);
+    std::vector<int> pixel_offsets(mpi_size, 0);
+    std::vector<uint32_t> all_pixels;
+    if (mpi_rank == 0) {
+        for (int r = 0; r < mpi_size; ++r) {
+            for (int i = tile_offsets[r]; i < tile_offsets[r] + tile_counts[r]; ++i) {
+                pixel_counts[r] += tile_bounds(all_ids[i]).size().long_product();
+            }
+        }
+        std::partial_sum(
+            pixel_counts.begin(), pixel_counts.end() - 1, pixel_offsets.begin() + 1);
+        all_pixels.resize(img_size.long_product(), 0);
+    }
+    MPI_Gatherv(rendered_pixels.data(),
+                rendered_pixels.size(),
+                MPI_UINT32_T,
+                all_pixels.data(),
+                pixel_counts.data(),
+                pixel_offsets.data(),
+                MPI_UINT32_T,
+                0,
+                MPI_COMM_WORLD);
+
+    if (mpi_rank != 0) {
+        return;
+    }
+    size_t offset = 0;
+    for (const auto &t : all_ids) {
+        const box2i bounds = tile_bounds(t);
+        const vec2i size = bounds.size();
+        for (int y = 0; y < size.y; ++y) {
+            std::copy(all_pixels.begin() + offset + size_t(y) * size.x,
+                      all_pixels.begin() + offset + size_t(y + 1) * size.x,
+                      final_img.begin() + size_t(bounds.lower.y + y) * img_size.x +
+                          bounds.lower.x);
+        }
+        offset += size.long_product();
+    }
 }
 
+#if ICET_ENABLED
 // IceT doesn't let us send a void* through to the draw callback, so have to do some
 // annoying global state
 static IceTBackend *icet_backend = nullptr;
 
 IceTBackend::IceTBackend(const vec2i &img_dims,
                          const vec3i &volume_dims,
+                         const int bricks_per_rank,
                          bool detailed_cpu_stats,
                          const vec3f &bg_color)
     : RenderBackend(img_dims, detailed_cpu_stats, bg_color),
       renderer("scivis"),
+      region_camera("perspective"),
       icet_comm(icetCreateMPICommunicator(MPI_COMM_WORLD)),
       icet_context(icetCreateContext(icet_comm)),
       icet_img(icetImageNull())
@@ -89,15 +525,7 @@ IceTBackend::IceTBackend(const vec2i &img_dims,
     // Setup IceT for single-image alpha-blended ordered compositing
     icetStrategy(ICET_STRATEGY_SEQUENTIAL);
     const std::string icet_strategy = get_env("OSP_ICET_STRATEGY");
-    if (icet_strategy.empty()) {
-        icetSingleImageStrategy(ICET_SINGLE_IMAGE_STRATEGY_AUTOMATIC);
-    } else if (icet_strategy == "BSWAP") {
-        icetSingleImageStrategy(ICET_SINGLE_IMAGE_STRATEGY_BSWAP);
-    } else if (icet_strategy == "RADIXK") {
-        icetSingleImageStrategy(ICET_SINGLE_IMAGE_STRATEGY_RADIXK);
-    } else if (icet_strategy == "TREE") {
-        icetSingleImageStrategy(ICET_SINGLE_IMAGE_STRATEGY_TREE);
-    }
+    set_single_image_strategy(icet_strategy.empty() ? "AUTOMATIC" : icet_strategy);
 
     icetEnable(ICET_ORDERED_COMPOSITE);
     icetEnable(ICET_CORRECT_COLORED_BACKGROUND);
@@ -109,8 +537,10 @@ IceTBackend::IceTBackend(const vec2i &img_dims,
     icetAddTile(0, 0, img_size.x, img_size.y, 0);
 
     icetDrawCallback(icet_draw_callback);
+    use_draw_callback = get_env("OSP_ICET_DRAW_CALLBACK") == "1";
 
-    compute_brick_grid(volume_dims);
+    volume_tree = KdTree(volume_dims, mpi_size, bricks_per_rank);
+    brick_placement = compute_brick_placement(mpi_size, bricks_per_rank);
 }
 
 IceTBackend::~IceTBackend()
@@ -118,43 +548,95 @@ IceTBackend::~IceTBackend()
     icetDestroyContext(icet_context);
 }
 
-size_t IceTBackend::render(const cpp::Camera &cam, const cpp::World &w, const vec3f &cam_pos)
+size_t IceTBackend::render(const cpp::Camera &cam,
+                           const cpp::World &w,
+                           const Camera &view,
+                           const bool culled)
 {
     using namespace std::chrono;
 
-    for (auto &b : volume_bricks) {
-        b.max_distance = brick_distance(b, cam_pos);
-    }
-
-    std::sort(volume_bricks.begin(),
-              volume_bricks.end(),
-              [&](const BrickInfo &a, const BrickInfo &b) {
-                  return a.max_distance < b.max_distance;
-              });
+    // Multiple IceT backends may be in use, e.g. for progressive rendering
+    icetSetContext(icet_context);
 
-    std::vector<int> process_order;
-    std::transform(volume_bricks.begin(),
-                   volume_bricks.end(),
-                   std::back_inserter(process_order),
-                   [](const BrickInfo &b) { return b.owner; });
+    const std::vector<int> process_order =
+        compute_composite_order(volume_tree, brick_placement, view.pos);
     icetCompositeOrder(process_order.data());
 
-    const std::array<double, 16> identity_mat = {
-        1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1};
+    // IceT projects the rank's bounds with the view to restrict compositing to the
+    // region they cover, and only that region is rendered locally
+    std::array<double, 16> proj_mat;
+    std::array<double, 16> modelview_mat;
+    render_region = set_view_bounds(view, proj_mat, modelview_mat);
     const std::array<float, 4> icet_bgcolor = {bg_color.x, bg_color.y, bg_color.z, 1.f};
 
     icet_backend = this;
     world = &w;
-    camera = &cam;
+    set_camera_view(region_camera, view, img_size);
+    frame_culled = culled;
 
     ProfilingPoint start;
-    icet_img = icetDrawFrame(identity_mat.data(), identity_mat.data(), icet_bgcolor.data());
+    const vec2i region_size = render_region.size();
+    if ((culled || region_size.long_product() == 0) && !use_draw_callback) {
+        // Culled ranks hand IceT an empty image, which it compresses down to a single
+        // run of inactive pixels, so they only take part in compositing
+        if (empty_img.empty()) {
+            empty_img.resize(img_size.long_product() * 4, 0);
+        }
+        handoff_time = 0.0;
+        local_render_time = 0.0;
+        icet_img = icetCompositeImage(empty_img.data(),
+                                      nullptr,
+                                      nullptr,
+                                      proj_mat.data(),
+                                      modelview_mat.data(),
+                                      icet_bgcolor.data());
+    } else if (use_draw_callback) {
+        // IceT skips the draw callback if the region doesn't overlap any tiles
+        handoff_time = 0.0;
+        local_render_time = 0.0;
+        icet_img = icetDrawFrame(proj_mat.data(), modelview_mat.data(), icet_bgcolor.data());
+    } else if (region_size.long_product() < img_size.long_product()) {
+        // Only the pixels in the region are valid, so IceT doesn't read the rest of the
+        // image
+        if (region_img.empty()) {
+            region_img.resize(img_size.long_product() * 4, 0);
+        }
+        render_local_region(render_region, region_img.data());
+        const std::array<int, 4> valid_viewport = {
+            render_region.lower.x, render_region.lower.y, region_size.x, region_size.y};
+        icet_img = icetCompositeImage(region_img.data(),
+                                      nullptr,
+                                      valid_viewport.data(),
+                                      proj_mat.data(),
+                                      modelview_mat.data(),
+                                      icet_bgcolor.data());
+    } else {
+        // IceT reads the pixels straight from the mapped framebuffer when compositing,
+        // so the local rendering isn't copied into an IceT image first
+        fb.renderFrame(renderer, cam, w).wait();
+        const ProfilingPoint handoff_start;
+        local_render_time = duration_cast<duration<double, std::milli>>(handoff_start.time -
+                                                                        start.time)
+                                .count();
+        const void *img = fb.map(OSP_FB_COLOR);
+        handoff_time = duration_cast<duration<double, std::milli>>(ProfilingPoint().time -
+                                                                   handoff_start.time)
+                           .count();
+        icet_img = icetCompositeImage(img,
+                                      nullptr,
+                                      nullptr,
+                                      proj_mat.data(),
+                                      modelview_mat.data(),
+                                      icet_bgcolor.data());
+        fb.unmap(const_cast<void *>(img));
+    }
     ProfilingPoint end;
 
     double local_composite_time = 0;
-    double local_render_time = 0;
     icetGetDoublev(ICET_COMPOSITE_TIME, &local_composite_time);
-    icetGetDoublev(ICET_RENDER_TIME, &local_render_time);
+    double total_draw_time = 0;
+    icetGetDoublev(ICET_TOTAL_DRAW_TIME, &total_draw_time);
+    draw_time = total_draw_time * 1000.0;
 
     // Compositing overhead is the time between the last local rendering
     // completing and the compositing finishing, so the min time reported
@@ -167,8 +649,31 @@ size_t IceTBackend::render(const cpp::Camera &cam, const cpp::World &w, const ve
                MPI_MIN,
                0,
                MPI_COMM_WORLD);
+    double max_handoff_time = 0;
+    MPI_Reduce(
+        &handoff_time, &max_handoff_time, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+    const int local_culled = culled ? 1 : 0;
+    int num_culled = 0;
+    MPI_Reduce(&local_culled, &num_culled, 1, MPI_INT, MPI_SUM, 0, MPI_COMM_WORLD);
+    // The fraction of the image rendered locally, averaged over the ranks
+    const double local_region_fraction =
+        culled ? 0.0 : double(render_region.size().long_product()) / img_size.long_product();
+    double region_fraction = 0.0;
+    MPI_Reduce(&local_region_fraction,
+               &region_fraction,
+               1,
+               MPI_DOUBLE,
+               MPI_SUM,
+               0,
+               MPI_COMM_WORLD);
     if (mpi_rank == 0) {
         std::cout << "IceT Compositing Overhead: " << compositing_overhead * 1000.f << "ms\n"
+                  << "IceT Culled Ranks: " << num_culled << "\n"
+                  << "IceT Avg. Rendered Region: "
+                  << 100.0 * region_fraction / mpi_size << "% of the image\n"
+                  << "IceT Framebuffer Handoff ("
+                  << (use_draw_callback ? "draw callback" : "composite image")
+                  << "): " << max_handoff_time << "ms\n"
                   << "IceT Strategy: " << icetGetStrategyName()
                   << "\nIceT Single Image Strategy: " << icetGetSingleImageStrategyName()
                   << "\n";
@@ -187,52 +692,192 @@ const uint32_t *IceTBackend::map_fb()
 
 void IceTBackend::unmap_fb(const uint32_t *mapping) {}
 
-void IceTBackend::compute_brick_grid(const vec3i &volume_dims)
+void IceTBackend::set_volume_tree(const KdTree &tree)
 {
-    volume_bricks.clear();
+    volume_tree = tree;
+}
 
-    const vec3i grid = compute_grid(mpi_size);
-    const vec3i brick_dims = volume_dims / grid;
-    int owner = 0;
-    for (int z = 0; z < grid.z; ++z) {
-        for (int y = 0; y < grid.y; ++y) {
-            for (int x = 0; x < grid.x; ++x) {
-                vec3i pos = vec3i(x, y, z) * brick_dims;
-                volume_bricks.emplace_back(pos, brick_dims, owner++);
-            }
+bool IceTBackend::set_display_wall(const DisplayWall &wall)
+{
+    icetSetContext(icet_context);
+    icetResetTiles();
+    if (wall.empty()) {
+        icetAddTile(0, 0, img_size.x, img_size.y, 0);
+        icetStrategy(ICET_STRATEGY_SEQUENTIAL);
+    } else {
+        for (size_t i = 0; i < wall.tiles.size(); ++i) {
+            const box2i &tile = wall.tiles[i];
+            const vec2i size = tile.size();
+            icetAddTile(tile.lower.x, tile.lower.y, size.x, size.y, wall.display_ranks[i]);
+        }
+        // The reduce strategy splits the ranks among the tiles to composite them in
+        // parallel
+        icetStrategy(ICET_STRATEGY_REDUCE);
+    }
+    // The local renderings cover the whole image, while IceT otherwise assumes they're
+    // the size of the largest tile
+    icetPhysicalRenderSize(img_size.x, img_size.y);
+    return true;
+}
+
+box2i IceTBackend::set_view_bounds(const Camera &view,
+                                   std::array<double, 16> &proj_mat,
+                                   std::array<double, 16> &modelview_mat)
+{
+    // The bricks' voxel bounds in the k-d tree are their world space bounds
+    const std::vector<int> &rank_bricks = brick_placement.rank_bricks[mpi_rank];
+    const box3i &first_brick = volume_tree.bricks[rank_bricks.front()];
+    box3f bounds(vec3f(first_brick.lower), vec3f(first_brick.upper));
+    for (const auto &b : rank_bricks) {
+        bounds.extend(vec3f(volume_tree.bricks[b].lower));
+        bounds.extend(vec3f(volume_tree.bricks[b].upper));
+    }
+
+    // The camera's basis and image plane, matching OSPRay's perspective camera
+    const vec3f dir = normalize(view.dir);
+    const vec3f right = normalize(cross(dir, view.up));
+    const vec3f up = cross(right, dir);
+    const float tan_y = std::tan(fovy * float(M_PI) / 360.f);
+    const float tan_x = tan_y * img_size.x / img_size.y;
+
+    float near_depth = std::numeric_limits<float>::infinity();
+    float far_depth = 0.f;
+    vec2f lower(std::numeric_limits<float>::infinity());
+    vec2f upper(-std::numeric_limits<float>::infinity());
+    for (int i = 0; i < 8; ++i) {
+        const vec3f corner(i & 1 ? bounds.upper.x : bounds.lower.x,
+                           i & 2 ? bounds.upper.y : bounds.lower.y,
+                           i & 4 ? bounds.upper.z : bounds.lower.z);
+        const vec3f v = corner - view.pos;
+        const float depth = dot(v, dir);
+        near_depth = std::min(near_depth, depth);
+        far_depth = std::max(far_depth, depth);
+        const vec2f p(dot(v, right) / (depth * tan_x), dot(v, up) / (depth * tan_y));
+        lower = min(lower, p);
+        upper = max(upper, p);
+    }
+
+    proj_mat.fill(0.0);
+    modelview_mat.fill(0.0);
+    if (near_depth <= 0.f) {
+        // Bounds reaching behind the camera can't be projected, so they're set to the
+        // whole screen with identity matrices
+        for (int i = 0; i < 4; ++i) {
+            proj_mat[i * 5] = 1.0;
+            modelview_mat[i * 5] = 1.0;
         }
+        icetBoundingBoxd(-1.0, 1.0, -1.0, 1.0, -1.0, 1.0);
+        return box2i(vec2i(0), img_size);
     }
+
+    // Column-major OpenGL style look-at and perspective matrices, with the near and
+    // far planes placed around the bounds
+    const std::array<vec3f, 3> rows = {right, up, -dir};
+    for (int i = 0; i < 3; ++i) {
+        modelview_mat[i] = rows[i].x;
+        modelview_mat[4 + i] = rows[i].y;
+        modelview_mat[8 + i] = rows[i].z;
+        modelview_mat[12 + i] = -dot(rows[i], view.pos);
+    }
+    modelview_mat[15] = 1.0;
+
+    const double z_near = 0.5 * near_depth;
+    const double z_far = 2.0 * far_depth;
+    proj_mat[0] = 1.0 / tan_x;
+    proj_mat[5] = 1.0 / tan_y;
+    proj_mat[10] = (z_far + z_near) / (z_near - z_far);
+    proj_mat[11] = -1.0;
+    proj_mat[14] = 2.0 * z_far * z_near / (z_near - z_far);
+
+    icetBoundingBoxd(bounds.lower.x,
+                     bounds.upper.x,
+                     bounds.lower.y,
+                     bounds.upper.y,
+                     bounds.lower.z,
+                     bounds.upper.z);
+
+    // The pixels covered by the projected bounds, padded by a pixel so the region
+    // contains all the pixels IceT treats as covered
+    box2i region;
+    for (int i = 0; i < 2; ++i) {
+        const float lo = std::floor((lower[i] + 1.f) * 0.5f * img_size[i]) - 1.f;
+        const float hi = std::ceil((upper[i] + 1.f) * 0.5f * img_size[i]) + 1.f;
+        region.lower[i] = std::clamp(lo, 0.f, float(img_size[i]));
+        region.upper[i] = std::clamp(hi, float(region.lower[i]), float(img_size[i]));
+    }
+    return region;
 }
 
-float IceTBackend::brick_distance(const BrickInfo &brick, const vec3f &p)
+void IceTBackend::render_local_region(const box2i &region, uint8_t *img)
 {
-    // Need to check along (0, 0, 0), (1, 0, 0), (0, 1, 0), (0, 0, 1), (1, 1, 0),
-    // (1, 0, 1), (0, 1, 1), (1, 1, 1) directions for each corner
-    const static std::array<vec3f, 8> dirs = {vec3f(0, 0, 0),
-                                              vec3f(1, 0, 0),
-                                              vec3f(0, 1, 0),
-                                              vec3f(0, 0, 1),
-                                              vec3f(1, 1, 0),
-                                              vec3f(1, 0, 1),
-                                              vec3f(0, 1, 1),
-                                              vec3f(1, 1, 1)};
+    using namespace std::chrono;
+    const vec2i size = region.size();
+    auto fb_it = region_fbs.find(std::make_pair(size.x, size.y));
+    if (fb_it == region_fbs.end()) {
+        cpp::FrameBuffer region_fb(size.x, size.y, OSP_FB_SRGBA, OSP_FB_COLOR);
+        region_fb.commit();
+        fb_it = region_fbs.emplace(std::make_pair(size.x, size.y), region_fb).first;
+    }
 
-    float max_dist = -std::numeric_limits<float>::infinity();
-    for (const auto &d : dirs) {
-        max_dist = std::max(length(vec3f(brick.pos) + d * vec3f(brick.dims) - p), max_dist);
+    region_camera.setParam("imageStart", vec2f(region.lower) / vec2f(img_size));
+    region_camera.setParam("imageEnd", vec2f(region.upper) / vec2f(img_size));
+    region_camera.commit();
+    const ProfilingPoint render_start;
+    fb_it->second.renderFrame(renderer, region_camera, *world).wait();
+    const ProfilingPoint handoff_start;
+    local_render_time =
+        duration_cast<duration<double, std::milli>>(handoff_start.time - render_start.time)
+            .count();
+
+    // Copy the region's rows into their place in the image
+    const uint8_t *region_img = static_cast<const uint8_t *>(fb_it->second.map(OSP_FB_COLOR));
+    for (int y = 0; y < size.y; ++y) {
+        std::memcpy(img + ((size_t(region.lower.y) + y) * img_size.x + region.lower.x) * 4,
+                    region_img + size_t(y) * size.x * 4,
+                    size.x * 4);
     }
-    return max_dist;
+    fb_it->second.unmap(const_cast<uint8_t *>(region_img));
+    handoff_time =
+        duration_cast<duration<double, std::milli>>(ProfilingPoint().time - handoff_start.time)
+            .count();
 }
 
-void IceTBackend::draw_callback(IceTImage &result)
+bool IceTBackend::set_single_image_strategy(const std::string &name)
 {
-    fb.renderFrame(renderer, *camera, *world);
+    icetSetContext(icet_context);
+    if (name == "AUTOMATIC") {
+        icetSingleImageStrategy(ICET_SINGLE_IMAGE_STRATEGY_AUTOMATIC);
+    } else if (name == "BSWAP") {
+        icetSingleImageStrategy(ICET_SINGLE_IMAGE_STRATEGY_BSWAP);
+    } else if (name == "RADIXK") {
+        icetSingleImageStrategy(ICET_SINGLE_IMAGE_STRATEGY_RADIXK);
+    } else if (name == "TREE") {
+        icetSingleImageStrategy(ICET_SINGLE_IMAGE_STRATEGY_TREE);
+    } else {
+        return false;
+    }
+    return true;
+}
 
-    // Copy the local OSPRay rendering out to IceT
-    uint8_t *img = static_cast<uint8_t *>(fb.map(OSP_FB_COLOR));
+void IceTBackend::draw_callback(IceTImage &result, const int *readback_viewport)
+{
     uint8_t *output = icetImageGetColorub(result);
-    std::memcpy(output, img, img_size.x * img_size.y * 4);
-    fb.unmap(img);
+    if (frame_culled) {
+        std::memset(output, 0, img_size.x * img_size.y * 4);
+        handoff_time = 0.0;
+        local_render_time = 0.0;
+        return;
+    }
+    // IceT only reads back the part of the image covered by the rank's bounds
+    const vec2i viewport_lower(readback_viewport[0], readback_viewport[1]);
+    const box2i region(viewport_lower,
+                       viewport_lower + vec2i(readback_viewport[2], readback_viewport[3]));
+    if (region.size().long_product() > 0) {
+        render_local_region(region, output);
+    } else {
+        handoff_time = 0.0;
+        local_render_time = 0.0;
+    }
 }
 
 void IceTBackend::icet_draw_callback(const double *proj_mat,
@@ -241,6 +886,1541 @@ void IceTBackend::icet_draw_callback(const double *proj_mat,
                                      const int *readback_viewport,
                                      IceTImage result)
 {
-    icet_backend->draw_callback(result);
+    icet_backend->draw_callback(result, readback_viewport);
 }
 #endif
+
+NativeCompositorBackend::NativeCompositorBackend(const vec2i &img_dims,
+                                                 const vec3i &volume_dims,
+                                                 const int bricks_per_rank,
+                                                 bool detailed_cpu_stats,
+                                                 const vec3f &bg_color,
+                                                 const CompositeOptions &options)
+    : RenderBackend(img_dims, detailed_cpu_stats, bg_color),
+      renderer("scivis"),
+      options(options)
+{
+    renderer.setParam("volumeSamplingRate", 1.f);
+    renderer.setParam("bgColor", vec4f(0.f));
+    renderer.commit();
+
+    if (renders_float()) {
+        fb = cpp::FrameBuffer(
+            img_dims.x, img_dims.y, OSP_FB_RGBA32F, OSP_FB_COLOR | OSP_FB_DEPTH);
+        fb.commit();
+    }
+    if (keeps_float_render()) {
+        float_render.resize(img_dims.long_product(), vec4f(0.f));
+    }
+    allocate_images(options.format);
+
+    volume_tree = KdTree(volume_dims, mpi_size, bricks_per_rank);
+    brick_placement = compute_brick_placement(mpi_size, bricks_per_rank);
+    culled_ranks.resize(mpi_size, 0);
+}
+
+size_t NativeCompositorBackend::render(const cpp::Camera &camera,
+                                       const cpp::World &world,
+                                       const Camera &view,
+                                       const bool culled)
+{
+    queue_frame(camera, world, view, culled);
+    size_t render_time = 0;
+    while (!queued_frames.empty()) {
+        render_time = finish_frame();
+    }
+    return render_time;
+}
+
+void NativeCompositorBackend::queue_frame(const cpp::Camera &camera,
+                                          const cpp::World &world,
+                                          const Camera &view,
+                                          const bool culled)
+{
+    RenderBackend::queue_frame(camera, world, view, culled);
+    // Start rendering right away if there's no earlier frame waiting to be rendered,
+    // otherwise it's started once the frame in front of it is done rendering
+    if (queued_frames.size() == 1 && pipelines_frames()) {
+        start_render(queued_frames.back());
+    }
+}
+
+size_t NativeCompositorBackend::finish_frame()
+{
+    using namespace std::chrono;
+    QueuedFrame frame = queued_frames.front();
+    queued_frames.pop_front();
+    const std::vector<int> composite_order =
+        compute_composite_order(volume_tree, brick_placement, frame.view.pos);
+
+    const int local_culled = frame.culled ? 1 : 0;
+    MPI_Allgather(
+        &local_culled, 1, MPI_INT, culled_ranks.data(), 1, MPI_INT, MPI_COMM_WORLD);
+    const int num_culled = std::accumulate(culled_ranks.begin(), culled_ranks.end(), 0);
+
+    // The frame's time is from when its local rendering started
+    const ProfilingPoint start = frame.started ? frame.start : ProfilingPoint();
+    ProfilingPoint local_render_end;
+    render_composite(frame, composite_order, local_render_end);
+    ProfilingPoint end;
+    local_render_time =
+        duration_cast<duration<double, std::milli>>(local_render_end.time - start.time)
+            .count();
+
+    // Compositing overhead is the time between the last local rendering
+    // completing and the compositing finishing, so the min time any rank
+    // spent in compositing
+    const double local_composite_time =
+        duration_cast<duration<double, std::milli>>(end.time - local_render_end.time).count();
+    double compositing_overhead = 0;
+    MPI_Reduce(&local_composite_time,
+               &compositing_overhead,
+               1,
+               MPI_DOUBLE,
+               MPI_MIN,
+               0,
+               MPI_COMM_WORLD);
+
+    // Report the slowest rank's time for each round
+    const std::vector<double> local_round_times = round_times();
+    std::vector<double> max_round_times(local_round_times.size(), 0.0);
+    MPI_Reduce(local_round_times.data(),
+               max_round_times.data(),
+               local_round_times.size(),
+               MPI_DOUBLE,
+               MPI_MAX,
+               0,
+               MPI_COMM_WORLD);
+
+    // Report the total partial image data sent by all ranks and how much it was compressed
+    std::array<uint64_t, 3> local_bytes = {uint64_t(exchange_stats.raw_bytes),
+                                           uint64_t(exchange_stats.sent_bytes),
+                                           uint64_t(exchange_stats.delta_avoided_bytes)};
+    std::array<uint64_t, 3> total_bytes = {0, 0, 0};
+    MPI_Reduce(local_bytes.data(),
+               total_bytes.data(),
+               local_bytes.size(),
+               MPI_UINT64_T,
+               MPI_SUM,
+               0,
+               MPI_COMM_WORLD);
+
+    // The reference composites are done after the timed frame so they don't affect the
+    // reported statistics
+    vec3f precision_error(0.f);
+    if (options.report_precision_error) {
+        precision_error = compare_to_reference(composite_order, PixelFormat::RGBA32F);
+    }
+    vec3f lossy_error(0.f);
+    if (options.lossy()) {
+        lossy_error = compare_to_reference(composite_order, options.format);
+    }
+
+    if (mpi_rank == 0) {
+        std::cout << name() << " Compositing Overhead: " << compositing_overhead << "ms\n"
+                  << name() << " Culled Ranks: " << num_culled << "\n";
+        for (size_t i = 0; i < max_round_times.size(); ++i) {
+            std::cout << name() << " Round " << i << ": " << max_round_times[i] << "ms\n";
+        }
+        const double compression_ratio =
+            total_bytes[1] > 0 ? double(total_bytes[0]) / total_bytes[1] : 1.0;
+        std::cout << name() << " Pixel Format: " << pixel_format_name(options.format) << "\n"
+                  << name() << " Bytes Sent: " << total_bytes[1] << "b (uncompressed "
+                  << total_bytes[0] << "b)\n"
+                  << name() << " Compression Ratio: " << compression_ratio << "\n";
+        if (options.temporal_delta) {
+            std::cout << name() << " Bytes Avoided by Temporal Delta: " << total_bytes[2]
+                      << "b\n";
+        }
+        if (options.lossy()) {
+            // Negative if the quantized blocks were larger than the raw pixels
+            const int64_t bytes_saved = int64_t(total_bytes[0]) - int64_t(total_bytes[1]);
+            std::cout << name() << " Bytes Saved: " << bytes_saved << "b\n"
+                      << name() << " Lossy Error vs. uncompressed: RMSE " << lossy_error.x
+                      << ", Max " << lossy_error.y << ", PSNR " << lossy_error.z << "dB\n";
+        }
+        if (options.report_precision_error) {
+            std::cout << name() << " Error vs. rgba32f: RMSE " << precision_error.x
+                      << ", Max " << precision_error.y << ", PSNR " << precision_error.z
+                      << "dB\n";
+        }
+    }
+    if (report_cpu_stats) {
+        std::cout << "rank " << mpi_rank << ", CPU: " << cpu_utilization(start, end) << "%\n";
+        MPI_Barrier(MPI_COMM_WORLD);
+    }
+    return elapsed_time_ms(start, end);
+}
+
+size_t NativeCompositorBackend::render_layers(const std::vector<cpp::Camera> &cameras,
+                                              const cpp::World &world,
+                                              const Camera &view,
+                                              const bool culled)
+{
+    if (cameras.size() > size_t(num_layers)) {
+        throw std::runtime_error("More views than layers in the batched frame");
+    }
+    // Batched frames aren't pipelined, so any queued frames are finished first
+    while (!queued_frames.empty()) {
+        finish_frame();
+    }
+    QueuedFrame frame;
+    frame.layer_cameras = cameras;
+    frame.world = world;
+    frame.view = view;
+    frame.culled = culled;
+    queued_frames.push_back(frame);
+    return finish_frame();
+}
+
+const uint32_t *NativeCompositorBackend::map_fb()
+{
+    return display_wall.empty() ? final_img.data() : display_img.data();
+}
+
+void NativeCompositorBackend::unmap_fb(const uint32_t *) {}
+
+void NativeCompositorBackend::set_volume_tree(const KdTree &tree)
+{
+    volume_tree = tree;
+}
+
+bool NativeCompositorBackend::set_display_wall(const DisplayWall &wall)
+{
+    display_wall = wall;
+    const int tile = display_wall.rank_tile(mpi_rank);
+    display_img.clear();
+    if (tile != -1) {
+        display_img.resize(display_wall.tiles[tile].size().long_product(), 0);
+    }
+    return true;
+}
+
+void NativeCompositorBackend::write_frame(const std::string &fname)
+{
+    if (gathers_frame()) {
+        RenderBackend::write_frame(fname);
+        return;
+    }
+
+    std::vector<uint32_t> converted;
+    write_ppm(fname, owned_regions(), owned_rgba8_pixels(converted));
+}
+
+std::vector<double> NativeCompositorBackend::round_times() const
+{
+    return std::vector<double>();
+}
+
+// Blend the constant background pixel under the pixels
+template <typename Pixel>
+static void blend_constant_background(Pixel *pixels, const size_t n, const Pixel &bg)
+{
+    const std::vector<Pixel> background(n, bg);
+    blend_images(pixels, background.data(), pixels, n);
+}
+
+void NativeCompositorBackend::blend_background(uint32_t *pixels, const size_t n) const
+{
+    const vec4f bg(bg_color * 255.f, 255.f);
+    const uint32_t bg_pixel = uint32_t(bg.x) | (uint32_t(bg.y) << 8) | (uint32_t(bg.z) << 16) |
+                              (uint32_t(bg.w) << 24);
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, n),
+                      [&](const tbb::blocked_range<size_t> &r) {
+                          for (size_t i = r.begin(); i < r.end(); ++i) {
+                              pixels[i] = blend_over(pixels[i], bg_pixel);
+                          }
+                      });
+}
+
+void NativeCompositorBackend::blend_background(RGBA16F *pixels, const size_t n) const
+{
+    // The background color is treated as sRGB like in RGBA8, so the final images match
+    const RGBA16F bg_pixel = {float_to_half(srgb_to_linear(bg_color.x)),
+                              float_to_half(srgb_to_linear(bg_color.y)),
+                              float_to_half(srgb_to_linear(bg_color.z)),
+                              float_to_half(1.f)};
+    blend_constant_background(pixels, n, bg_pixel);
+}
+
+void NativeCompositorBackend::blend_background(vec4f *pixels, const size_t n) const
+{
+    const vec4f bg_pixel(srgb_to_linear(bg_color.x),
+                         srgb_to_linear(bg_color.y),
+                         srgb_to_linear(bg_color.z),
+                         1.f);
+    blend_constant_background(pixels, n, bg_pixel);
+}
+
+const uint32_t *NativeCompositorBackend::owned_rgba8_pixels(std::vector<uint32_t> &converted)
+{
+    size_t n = 0;
+    for (const auto &r : owned_regions()) {
+        n += (r.upper - r.lower).long_product();
+    }
+    // The float formats are converted to sRGB like the gathered final image
+    switch (options.format) {
+    case PixelFormat::RGBA8:
+        return static_cast<const uint32_t *>(owned_image_data());
+    case PixelFormat::RGBA16F: {
+        std::vector<vec4f> linear(n, vec4f(0.f));
+        converted.resize(n, 0);
+        convert_pixels(static_cast<const RGBA16F *>(owned_image_data()), linear.data(), n);
+        convert_pixels(linear.data(), converted.data(), n);
+        break;
+    }
+    case PixelFormat::RGBA32F:
+        converted.resize(n, 0);
+        convert_pixels(static_cast<const vec4f *>(owned_image_data()), converted.data(), n);
+        break;
+    }
+    return converted.data();
+}
+
+bool NativeCompositorBackend::keeps_float_render() const
+{
+    return options.report_precision_error || options.lossy();
+}
+
+bool NativeCompositorBackend::gathers_frame() const
+{
+    return (!distributed_output && display_wall.empty()) || keeps_float_render();
+}
+
+bool NativeCompositorBackend::renders_float() const
+{
+    // The float formats and the reference composites need a linear float rendering
+    return options.format != PixelFormat::RGBA8 || keeps_float_render();
+}
+
+void NativeCompositorBackend::allocate_images(const PixelFormat format)
+{
+    const size_t n = img_size.long_product();
+    switch (format) {
+    case PixelFormat::RGBA8:
+        local_img.resize(n, 0);
+        break;
+    case PixelFormat::RGBA16F:
+        local_img_half.resize(n, RGBA16F{0, 0, 0, 0});
+        break;
+    case PixelFormat::RGBA32F:
+        local_img_float.resize(n, vec4f(0.f));
+        break;
+    }
+
+    if (mpi_rank == 0) {
+        final_img.resize(n, 0);
+        if (renders_float()) {
+            final_img_float.resize(n, vec4f(0.f));
+        }
+        if (format == PixelFormat::RGBA16F) {
+            final_img_half.resize(n, RGBA16F{0, 0, 0, 0});
+        }
+    }
+}
+
+void NativeCompositorBackend::render_composite(QueuedFrame &frame,
+                                               const std::vector<int> &composite_order,
+                                               ProfilingPoint &local_render_end)
+{
+    if (!frame.started) {
+        start_render(frame);
+    }
+    if (!frame.culled && frame.layer_cameras.empty()) {
+        frame.render.wait();
+    }
+    cpp::FrameBuffer rendered = fb;
+
+    // Render the next frame to the back framebuffer while this one is composited
+    if (pipelines_frames() && !queued_frames.empty() && !queued_frames.front().started) {
+        if (!back_fb_allocated) {
+            back_fb = cpp::FrameBuffer(img_size.x,
+                                       img_size.y,
+                                       renders_float() ? OSP_FB_RGBA32F : OSP_FB_SRGBA,
+                                       OSP_FB_COLOR | OSP_FB_DEPTH);
+            back_fb.commit();
+            back_fb_allocated = true;
+        }
+        std::swap(fb, back_fb);
+        start_render(queued_frames.front());
+    }
+
+    if (frame.culled) {
+        clear_local_image();
+    } else if (!frame.layer_cameras.empty()) {
+        render_local_layers(frame);
+    } else {
+        read_local_render(rendered, 0, img_size.long_product());
+    }
+    local_render_end = ProfilingPoint();
+
+    composite_frame(composite_order);
+}
+
+bool NativeCompositorBackend::pipelines_frames() const
+{
+    return true;
+}
+
+void NativeCompositorBackend::start_render(QueuedFrame &frame)
+{
+    frame.start = ProfilingPoint();
+    if (!frame.culled && frame.layer_cameras.empty()) {
+        frame.render = fb.renderFrame(renderer, frame.camera, frame.world);
+    }
+    frame.started = true;
+}
+
+void NativeCompositorBackend::render_local_layers(const QueuedFrame &frame)
+{
+    const vec2i layer_size(img_size.x, img_size.y / num_layers);
+    if (!layer_fb_allocated) {
+        layer_fb = cpp::FrameBuffer(layer_size.x,
+                                    layer_size.y,
+                                    renders_float() ? OSP_FB_RGBA32F : OSP_FB_SRGBA,
+                                    OSP_FB_COLOR);
+        layer_fb.commit();
+        layer_fb_allocated = true;
+    }
+    // The layers without a view in a partial batch are empty
+    if (frame.layer_cameras.size() < size_t(num_layers)) {
+        clear_local_image();
+    }
+    const size_t n = layer_size.long_product();
+    for (size_t i = 0; i < frame.layer_cameras.size(); ++i) {
+        layer_fb.renderFrame(renderer, frame.layer_cameras[i], frame.world).wait();
+        read_local_render(layer_fb, i * n, n);
+    }
+}
+
+std::vector<int> NativeCompositorBackend::visible_order(
+    const std::vector<int> &composite_order) const
+{
+    std::vector<int> order;
+    std::copy_if(composite_order.begin(),
+                 composite_order.end(),
+                 std::back_inserter(order),
+                 [&](const int r) { return !culled_ranks[r]; });
+    return order;
+}
+
+void NativeCompositorBackend::clear_local_image()
+{
+    switch (options.format) {
+    case PixelFormat::RGBA8:
+        std::fill(local_img.begin(), local_img.end(), 0);
+        break;
+    case PixelFormat::RGBA16F:
+        std::fill(local_img_half.begin(), local_img_half.end(), RGBA16F{0, 0, 0, 0});
+        break;
+    case PixelFormat::RGBA32F:
+        std::fill(local_img_float.begin(), local_img_float.end(), vec4f(0.f));
+        break;
+    }
+    if (keeps_float_render()) {
+        std::fill(float_render.begin(), float_render.end(), vec4f(0.f));
+    }
+}
+
+void NativeCompositorBackend::read_local_render(cpp::FrameBuffer &src,
+                                                const size_t offset,
+                                                const size_t n)
+{
+    if (!renders_float()) {
+        const uint32_t *img = static_cast<const uint32_t *>(src.map(OSP_FB_COLOR));
+        std::memcpy(local_img.data() + offset, img, n * sizeof(uint32_t));
+        src.unmap(const_cast<uint32_t *>(img));
+        return;
+    }
+
+    const vec4f *img = static_cast<const vec4f *>(src.map(OSP_FB_COLOR));
+    load_local_image(img, offset, n);
+    if (keeps_float_render()) {
+        std::copy(img, img + n, float_render.begin() + offset);
+    }
+    src.unmap(const_cast<vec4f *>(img));
+}
+
+void NativeCompositorBackend::load_local_image(const vec4f *img,
+                                               const size_t offset,
+                                               const size_t n)
+{
+    switch (options.format) {
+    case PixelFormat::RGBA8:
+        convert_pixels(img, local_img.data() + offset, n);
+        break;
+    case PixelFormat::RGBA16F:
+        convert_pixels(img, local_img_half.data() + offset, n);
+        break;
+    case PixelFormat::RGBA32F:
+        std::copy(img, img + n, local_img_float.begin() + offset);
+        break;
+    }
+}
+
+void NativeCompositorBackend::composite_frame(const std::vector<int> &composite_order,
+                                              const bool reference)
+{
+    switch (options.format) {
+    case PixelFormat::RGBA8:
+        composite(composite_order, local_img);
+        break;
+    case PixelFormat::RGBA16F:
+        composite(composite_order, local_img_half);
+        break;
+    case PixelFormat::RGBA32F:
+        composite(composite_order, local_img_float);
+        break;
+    }
+    gather_frame(reference);
+}
+
+void NativeCompositorBackend::gather_frame(const bool reference)
+{
+    size_t n_owned = 0;
+    for (const auto &r : owned_regions()) {
+        n_owned += (r.upper - r.lower).long_product();
+    }
+    switch (options.format) {
+    case PixelFormat::RGBA8:
+        blend_background(static_cast<uint32_t *>(owned_image_data()), n_owned);
+        break;
+    case PixelFormat::RGBA16F:
+        blend_background(static_cast<RGBA16F *>(owned_image_data()), n_owned);
+        break;
+    case PixelFormat::RGBA32F:
+        blend_background(static_cast<vec4f *>(owned_image_data()), n_owned);
+        break;
+    }
+    if (!display_wall.empty() && !reference) {
+        send_display_tiles();
+    }
+    if (!gathers_frame()) {
+        return;
+    }
+
+    const size_t n = img_size.long_product();
+    switch (options.format) {
+    case PixelFormat::RGBA8:
+        gather_image(local_img, final_img);
+        break;
+    case PixelFormat::RGBA16F:
+        gather_image(local_img_half, final_img_half);
+        if (mpi_rank == 0) {
+            convert_pixels(final_img_half.data(), final_img_float.data(), n);
+            convert_pixels(final_img_float.data(), final_img.data(), n);
+        }
+        break;
+    case PixelFormat::RGBA32F:
+        gather_image(local_img_float, final_img_float);
+        if (mpi_rank == 0) {
+            convert_pixels(final_img_float.data(), final_img.data(), n);
+        }
+        break;
+    }
+}
+
+void NativeCompositorBackend::send_display_tiles()
+{
+    const std::vector<box2i> regions = owned_regions();
+    std::vector<uint32_t> converted;
+    const uint32_t *owned = owned_rgba8_pixels(converted);
+
+    // Each piece of a tile sent is its bounds followed by its rows of pixels
+    std::vector<std::vector<uint32_t>> pieces(mpi_size);
+    size_t offset = 0;
+    for (const auto &r : regions) {
+        const vec2i r_size = r.size();
+        for (size_t t = 0; t < display_wall.tiles.size(); ++t) {
+            const box2i &tile = display_wall.tiles[t];
+            const vec2i lower = max(r.lower, tile.lower);
+            const vec2i upper = min(r.upper, tile.upper);
+            if (lower.x >= upper.x || lower.y >= upper.y) {
+                continue;
+            }
+            std::vector<uint32_t> &buf = pieces[display_wall.display_ranks[t]];
+            buf.push_back(lower.x);
+            buf.push_back(lower.y);
+            buf.push_back(upper.x);
+            buf.push_back(upper.y);
+            for (int y = lower.y; y < upper.y; ++y) {
+                const uint32_t *row =
+                    owned + offset + size_t(y - r.lower.y) * r_size.x + lower.x - r.lower.x;
+                buf.insert(buf.end(), row, row + upper.x - lower.x);
+            }
+        }
+        offset += r_size.long_product();
+    }
+
+    std::vector<int> send_counts(mpi_size, 0);
+    std::vector<int> send_offsets(mpi_size, 0);
+    std::vector<uint32_t> send_buf;
+    for (int i = 0; i < mpi_size; ++i) {
+        send_counts[i] = pieces[i].size();
+        send_offsets[i] = send_buf.size();
+        send_buf.insert(send_buf.end(), pieces[i].begin(), pieces[i].end());
+    }
+    std::vector<int> recv_counts(mpi_size, 0);
+    MPI_Alltoall(
+        send_counts.data(), 1, MPI_INT, recv_counts.data(), 1, MPI_INT, MPI_COMM_WORLD);
+    std::vector<int> recv_offsets(mpi_size, 0);
+    std::partial_sum(recv_counts.begin(), recv_counts.end() - 1, recv_offsets.begin() + 1);
+    std::vector<uint32_t> recv_buf(recv_offsets.back() + recv_counts.back(), 0);
+    MPI_Alltoallv(send_buf.data(),
+                  send_counts.data(),
+                  send_offsets.data(),
+                  MPI_UINT32_T,
+                  recv_buf.data(),
+                  recv_counts.data(),
+                  recv_offsets.data(),
+                  MPI_UINT32_T,
+                  MPI_COMM_WORLD);
+
+    const int tile_id = display_wall.rank_tile(mpi_rank);
+    if (tile_id == -1) {
+        return;
+    }
+    const box2i &tile = display_wall.tiles[tile_id];
+    const int tile_width = tile.size().x;
+    for (size_t i = 0; i < recv_buf.size();) {
+        const vec2i lower(recv_buf[i], recv_buf[i + 1]);
+        const vec2i upper(recv_buf[i + 2], recv_buf[i + 3]);
+        i += 4;
+        const size_t width = upper.x - lower.x;
+        for (int y = lower.y; y < upper.y; ++y, i += width) {
+            std::copy(recv_buf.begin() + i,
+                      recv_buf.begin() + i + width,
+                      display_img.begin() + size_t(y - tile.lower.y) * tile_width + lower.x -
+                          tile.lower.x);
+        }
+    }
+}
+
+vec3f NativeCompositorBackend::compare_to_reference(const std::vector<int> &composite_order,
+                                                  const PixelFormat reference_format)
+{
+    const CompositeOptions frame_options = options;
+    const ExchangeStats frame_exchange_stats = exchange_stats;
+
+    // Keep the frame's final image, and the linear color of it to compare against
+    std::vector<uint32_t> frame_img;
+    std::vector<vec4f> frame_img_float;
+    if (mpi_rank == 0) {
+        frame_img = final_img;
+        if (options.format == PixelFormat::RGBA8) {
+            frame_img_float.resize(final_img.size(), vec4f(0.f));
+            convert_pixels(final_img.data(), frame_img_float.data(), final_img.size());
+        } else {
+            frame_img_float = final_img_float;
+        }
+    }
+
+    // The reference composite is sent in full so it doesn't replace the pieces kept for
+    // the next frame's temporal delta
+    options.format = reference_format;
+    options.error_bound = vec4f(0.f);
+    options.temporal_delta = false;
+    allocate_images(reference_format);
+    load_local_image(float_render.data(), 0, float_render.size());
+    composite_frame(composite_order, true);
+
+    vec3f error(0.f);
+    if (mpi_rank == 0) {
+        if (reference_format == PixelFormat::RGBA8) {
+            convert_pixels(final_img.data(), final_img_float.data(), final_img.size());
+        }
+        double squared_error = 0.0;
+        float max_error = 0.f;
+        for (size_t i = 0; i < frame_img_float.size(); ++i) {
+            for (int j = 0; j < 3; ++j) {
+                const float diff = std::abs(frame_img_float[i][j] - final_img_float[i][j]);
+                squared_error += diff * diff;
+                max_error = std::max(max_error, diff);
+            }
+        }
+        const float rmse = std::sqrt(squared_error / (3.0 * frame_img_float.size()));
+        const float psnr = rmse > 0.f ? 20.f * std::log10(1.f / rmse)
+                                      : std::numeric_limits<float>::infinity();
+        error = vec3f(rmse, max_error, psnr);
+
+        final_img = std::move(frame_img);
+        if (frame_options.format != PixelFormat::RGBA8) {
+            final_img_float = std::move(frame_img_float);
+        }
+    }
+    options = frame_options;
+    exchange_stats = frame_exchange_stats;
+    return error;
+}
+
+ScheduleCompositorBackend::ScheduleCompositorBackend(const vec2i &img_dims,
+                                                     const vec3i &volume_dims,
+                                                     const int bricks_per_rank,
+                                                     bool detailed_cpu_stats,
+                                                     const vec3f &bg_color,
+                                                     const CompositeOptions &options)
+    : NativeCompositorBackend(
+          img_dims, volume_dims, bricks_per_rank, detailed_cpu_stats, bg_color, options)
+{
+    if (options.node_local) {
+        node_compositor = std::make_unique<NodeCompositor>();
+        leader_compositor.comm = node_compositor->leader_comm;
+    }
+    active_ranks.resize(mpi_size);
+    std::iota(active_ranks.begin(), active_ranks.end(), 0);
+}
+
+ScheduleCompositorBackend::~ScheduleCompositorBackend()
+{
+    if (compositor.comm != MPI_COMM_WORLD && compositor.comm != MPI_COMM_NULL) {
+        MPI_Comm_free(&compositor.comm);
+    }
+}
+
+void ScheduleCompositorBackend::composite(const std::vector<int> &composite_order,
+                                          std::vector<uint32_t> &img)
+{
+    composite_pixels(composite_order, img);
+}
+
+void ScheduleCompositorBackend::composite(const std::vector<int> &composite_order,
+                                          std::vector<RGBA16F> &img)
+{
+    composite_pixels(composite_order, img);
+}
+
+void ScheduleCompositorBackend::composite(const std::vector<int> &composite_order,
+                                          std::vector<vec4f> &img)
+{
+    composite_pixels(composite_order, img);
+}
+
+void ScheduleCompositorBackend::gather_image(std::vector<uint32_t> &img,
+                                             std::vector<uint32_t> &out)
+{
+    gather_pixels(img, out);
+}
+
+void ScheduleCompositorBackend::gather_image(std::vector<RGBA16F> &img,
+                                             std::vector<RGBA16F> &out)
+{
+    gather_pixels(img, out);
+}
+
+void ScheduleCompositorBackend::gather_image(std::vector<vec4f> &img, std::vector<vec4f> &out)
+{
+    gather_pixels(img, out);
+}
+
+template <typename Pixel>
+void ScheduleCompositorBackend::composite_pixels(const std::vector<int> &composite_order,
+                                                 std::vector<Pixel> &img)
+{
+    // The node-local images can only be blended first if each node's ranks are
+    // contiguous in the composite order, otherwise all ranks composite together
+    composited_node_local =
+        node_compositor && node_compositor->nodes_contiguous(composite_order);
+    if (node_compositor && !composited_node_local && !warned_not_contiguous) {
+        if (mpi_rank == 0) {
+            std::cerr << "[warning]: The ranks on each node are not contiguous in the "
+                      << "composite order, skipping node-local compositing\n";
+        }
+        warned_not_contiguous = true;
+    }
+
+    if (!composited_node_local) {
+        // The culled ranks' images are empty, so they're left out of the schedule and
+        // the remaining ranks composite among themselves
+        update_active_ranks();
+        if (culled_ranks[mpi_rank]) {
+            owned_range = vec2i(0);
+            exchange_stats = ExchangeStats();
+            compositor.round_times = std::vector<double>(compositor.schedule.size(), 0.0);
+            return;
+        }
+        std::vector<int> active_order = visible_order(composite_order);
+        for (auto &r : active_order) {
+            r = std::lower_bound(active_ranks.begin(), active_ranks.end(), r) -
+                active_ranks.begin();
+        }
+        compositor.options = options;
+        owned_range = compositor.composite(active_order, img);
+        exchange_stats = compositor.exchange_stats;
+        return;
+    }
+
+    node_compositor->composite(composite_order, img);
+    owned_range = vec2i(0);
+    exchange_stats = ExchangeStats();
+    if (node_compositor->is_leader()) {
+        leader_compositor.options = options;
+        owned_range =
+            leader_compositor.composite(node_compositor->node_order(composite_order), img);
+        exchange_stats = leader_compositor.exchange_stats;
+    }
+}
+
+std::vector<box2i> ScheduleCompositorBackend::owned_regions() const
+{
+    // The owned range of pixels is split into the partial rows at each end and the
+    // full rows between them
+    std::vector<box2i> regions;
+    int i = owned_range.x;
+    while (i < owned_range.y) {
+        const vec2i lower(i % img_size.x, i / img_size.x);
+        int rows = 1;
+        int width = std::min(img_size.x - lower.x, owned_range.y - i);
+        if (lower.x == 0 && owned_range.y - i >= img_size.x) {
+            rows = (owned_range.y - i) / img_size.x;
+            width = img_size.x;
+        }
+        regions.push_back(box2i(lower, lower + vec2i(width, rows)));
+        i += width * rows;
+    }
+    return regions;
+}
+
+void *ScheduleCompositorBackend::owned_image_data()
+{
+    switch (options.format) {
+    case PixelFormat::RGBA8:
+        return local_img.data() + owned_range.x;
+    case PixelFormat::RGBA16F:
+        return local_img_half.data() + owned_range.x;
+    case PixelFormat::RGBA32F:
+        return local_img_float.data() + owned_range.x;
+    }
+    return nullptr;
+}
+
+template <typename Pixel>
+void ScheduleCompositorBackend::gather_pixels(std::vector<Pixel> &img, std::vector<Pixel> &out)
+{
+    Pixel *owned = img.data() + owned_range.x;
+
+    // The pixels are sent as words, see pixel_words
+    std::vector<vec2i> ranges(mpi_size, vec2i(0));
+    MPI_Gather(&owned_range.x, 2, MPI_INT, ranges.data(), 2, MPI_INT, 0, MPI_COMM_WORLD);
+
+    std::vector<int> counts, offsets;
+    for (const auto &r : ranges) {
+        offsets.push_back(r.x * pixel_words<Pixel>());
+        counts.push_back((r.y - r.x) * pixel_words<Pixel>());
+    }
+    MPI_Gatherv(owned,
+                (owned_range.y - owned_range.x) * pixel_words<Pixel>(),
+                MPI_UINT32_T,
+                out.data(),
+                counts.data(),
+                offsets.data(),
+                MPI_UINT32_T,
+                0,
+                MPI_COMM_WORLD);
+}
+
+std::vector<double> ScheduleCompositorBackend::round_times() const
+{
+    if (!composited_node_local) {
+        return compositor.round_times;
+    }
+    // The node-local blend is reported as the first round, the other ranks on the node
+    // don't take part in the rounds across the nodes
+    std::vector<double> times(leader_compositor.schedule.size() + 1, 0.0);
+    times[0] = node_compositor->blend_time;
+    if (node_compositor->is_leader()) {
+        std::copy(leader_compositor.round_times.begin(),
+                  leader_compositor.round_times.end(),
+                  times.begin() + 1);
+    }
+    return times;
+}
+
+int ScheduleCompositorBackend::num_nodes() const
+{
+    return node_compositor ? node_compositor->num_nodes : mpi_size;
+}
+
+void ScheduleCompositorBackend::update_active_ranks()
+{
+    // Rank 0 always takes part so the schedule has at least one rank, which composites
+    // an empty image if everything was culled, so it's no longer treated as culled
+    std::vector<int> active;
+    for (int i = 0; i < mpi_size; ++i) {
+        if (i == 0 || !culled_ranks[i]) {
+            active.push_back(i);
+        }
+    }
+    culled_ranks[0] = 0;
+    if (active == active_ranks) {
+        return;
+    }
+
+    active_ranks = active;
+    // The ranks are renumbered in the new communicator, so the pieces kept from the last
+    // frame no longer match up
+    compositor.reset_temporal_delta();
+    if (compositor.comm != MPI_COMM_WORLD && compositor.comm != MPI_COMM_NULL) {
+        MPI_Comm_free(&compositor.comm);
+    }
+    if (int(active_ranks.size()) == mpi_size) {
+        compositor.comm = MPI_COMM_WORLD;
+    } else {
+        MPI_Comm_split(MPI_COMM_WORLD,
+                       culled_ranks[mpi_rank] ? MPI_UNDEFINED : 0,
+                       mpi_rank,
+                       &compositor.comm);
+    }
+    compositor.schedule = make_schedule(active_ranks.size());
+}
+
+BinarySwapBackend::BinarySwapBackend(const vec2i &img_dims,
+                                     const vec3i &volume_dims,
+                                     const int bricks_per_rank,
+                                     bool detailed_cpu_stats,
+                                     const vec3f &bg_color,
+                                     const CompositeOptions &options)
+    : ScheduleCompositorBackend(
+          img_dims, volume_dims, bricks_per_rank, detailed_cpu_stats, bg_color, options)
+{
+    compositor.schedule = make_schedule(mpi_size);
+    leader_compositor.schedule = make_schedule(num_nodes());
+}
+
+std::string BinarySwapBackend::name() const
+{
+    return "BinarySwap";
+}
+
+std::vector<CompositeRound> BinarySwapBackend::make_schedule(const int num_ranks) const
+{
+    return binary_swap_schedule(num_ranks);
+}
+
+RadixKBackend::RadixKBackend(const vec2i &img_dims,
+                             const vec3i &volume_dims,
+                             const int bricks_per_rank,
+                             bool detailed_cpu_stats,
+                             const vec3f &bg_color,
+                             const CompositeOptions &options,
+                             const std::vector<int> &k_values)
+    : ScheduleCompositorBackend(
+          img_dims, volume_dims, bricks_per_rank, detailed_cpu_stats, bg_color, options),
+      k_values(k_values)
+{
+    compositor.schedule = make_schedule(mpi_size);
+    leader_compositor.schedule = make_schedule(num_nodes());
+    if (mpi_rank == 0) {
+        std::cout << "RadixK k-values:";
+        for (const auto &round : compositor.schedule) {
+            std::cout << " " << round.max_k();
+        }
+        std::cout << "\n";
+    }
+}
+
+std::string RadixKBackend::name() const
+{
+    return "RadixK";
+}
+
+std::vector<CompositeRound> RadixKBackend::make_schedule(const int num_ranks) const
+{
+    return radix_k_schedule(num_ranks, k_values);
+}
+
+TwoThreeSwapBackend::TwoThreeSwapBackend(const vec2i &img_dims,
+                                         const vec3i &volume_dims,
+                                         const int bricks_per_rank,
+                                         bool detailed_cpu_stats,
+                                         const vec3f &bg_color,
+                                         const CompositeOptions &options)
+    : ScheduleCompositorBackend(
+          img_dims, volume_dims, bricks_per_rank, detailed_cpu_stats, bg_color, options)
+{
+    compositor.schedule = make_schedule(mpi_size);
+    leader_compositor.schedule = make_schedule(num_nodes());
+}
+
+std::string TwoThreeSwapBackend::name() const
+{
+    return "TwoThreeSwap";
+}
+
+std::vector<CompositeRound> TwoThreeSwapBackend::make_schedule(const int num_ranks) const
+{
+    return two_three_swap_schedule(num_ranks);
+}
+
+// Copy the pixels of the tile out of the image into a contiguous tile buffer
+template <typename Pixel>
+static void copy_tile(const Pixel *img, const int img_width, const box2i &tile, Pixel *out)
+{
+    const int tile_width = tile.upper.x - tile.lower.x;
+    for (int y = tile.lower.y; y < tile.upper.y; ++y) {
+        std::copy(img + y * img_width + tile.lower.x,
+                  img + y * img_width + tile.upper.x,
+                  out + (y - tile.lower.y) * tile_width);
+    }
+}
+
+// Write the pixels of the tile buffer into the image
+template <typename Pixel>
+static void write_tile(const Pixel *tile_pixels,
+                       const box2i &tile,
+                       Pixel *img,
+                       const int img_width)
+{
+    const int tile_width = tile.upper.x - tile.lower.x;
+    for (int y = tile.lower.y; y < tile.upper.y; ++y) {
+        std::copy(tile_pixels + (y - tile.lower.y) * tile_width,
+                  tile_pixels + (y - tile.lower.y + 1) * tile_width,
+                  img + y * img_width + tile.lower.x);
+    }
+}
+
+// Check if any pixels in the tile are not fully empty
+template <typename Pixel>
+static bool tile_has_active_pixels(const Pixel *img, const int img_width, const box2i &tile)
+{
+    for (int y = tile.lower.y; y < tile.upper.y; ++y) {
+        for (int x = tile.lower.x; x < tile.upper.x; ++x) {
+            if (!pixel_empty(img[y * img_width + x])) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+DirectSendBackend::DirectSendBackend(const vec2i &img_dims,
+                                     const vec3i &volume_dims,
+                                     const int bricks_per_rank,
+                                     bool detailed_cpu_stats,
+                                     const vec3f &bg_color,
+                                     const CompositeOptions &options,
+                                     const int tile_size,
+                                     const int stream_bands)
+    : NativeCompositorBackend(
+          img_dims, volume_dims, bricks_per_rank, detailed_cpu_stats, bg_color, options),
+      tile_size(tile_size),
+      n_tiles((img_dims.x + tile_size - 1) / tile_size,
+              (img_dims.y + tile_size - 1) / tile_size),
+      stream_bands(std::max(1, std::min(stream_bands, n_tiles.y)))
+{
+    for (int t = mpi_rank; t < n_tiles.long_product(); t += mpi_size) {
+        const box2i tile = tile_bounds(t);
+        owned_pixels += (tile.upper - tile.lower).long_product();
+    }
+
+    int *attr_tag_ub = nullptr;
+    int has_tag_ub = 0;
+    MPI_Comm_get_attr(MPI_COMM_WORLD, MPI_TAG_UB, &attr_tag_ub, &has_tag_ub);
+    if (has_tag_ub) {
+        tag_ub = *attr_tag_ub;
+    }
+
+    if (this->stream_bands > 1) {
+        band_camera = cpp::Camera("perspective");
+        for (int b = 0; b < this->stream_bands; ++b) {
+            const vec2i rows = min(band_tile_rows(b) * tile_size, vec2i(img_dims.y));
+            band_fbs.emplace_back(img_dims.x,
+                                  rows.y - rows.x,
+                                  renders_float() ? OSP_FB_RGBA32F : OSP_FB_SRGBA,
+                                  OSP_FB_COLOR);
+            band_fbs.back().commit();
+        }
+    }
+}
+
+std::string DirectSendBackend::name() const
+{
+    return "DirectSend";
+}
+
+void DirectSendBackend::composite(const std::vector<int> &composite_order,
+                                  std::vector<uint32_t> &img)
+{
+    composite_tiles(composite_order, img);
+}
+
+void DirectSendBackend::composite(const std::vector<int> &composite_order,
+                                  std::vector<RGBA16F> &img)
+{
+    composite_tiles(composite_order, img);
+}
+
+void DirectSendBackend::composite(const std::vector<int> &composite_order,
+                                  std::vector<vec4f> &img)
+{
+    composite_tiles(composite_order, img);
+}
+
+void DirectSendBackend::gather_image(std::vector<uint32_t> &, std::vector<uint32_t> &out)
+{
+    gather_tiles(out);
+}
+
+void DirectSendBackend::gather_image(std::vector<RGBA16F> &, std::vector<RGBA16F> &out)
+{
+    gather_tiles(out);
+}
+
+void DirectSendBackend::gather_image(std::vector<vec4f> &, std::vector<vec4f> &out)
+{
+    gather_tiles(out);
+}
+
+void DirectSendBackend::render_composite(QueuedFrame &frame,
+                                         const std::vector<int> &composite_order,
+                                         ProfilingPoint &local_render_end)
+{
+    // Batched frames render each layer in full, so they aren't streamed
+    if (stream_bands == 1 || !frame.layer_cameras.empty()) {
+        NativeCompositorBackend::render_composite(frame, composite_order, local_render_end);
+        return;
+    }
+
+    switch (options.format) {
+    case PixelFormat::RGBA8:
+        stream_tiles(frame, composite_order, local_img, local_render_end);
+        break;
+    case PixelFormat::RGBA16F:
+        stream_tiles(frame, composite_order, local_img_half, local_render_end);
+        break;
+    case PixelFormat::RGBA32F:
+        stream_tiles(frame, composite_order, local_img_float, local_render_end);
+        break;
+    }
+    gather_frame();
+}
+
+bool DirectSendBackend::pipelines_frames() const
+{
+    return stream_bands == 1;
+}
+
+template <typename Pixel>
+void DirectSendBackend::composite_tiles(const std::vector<int> &composite_order,
+                                        const std::vector<Pixel> &img)
+{
+    const int total_tiles = n_tiles.long_product();
+
+    // Find which tiles our partial image covers and share this with the other ranks,
+    // so the tile owners know which ranks will send them each tile
+    std::vector<uint8_t> tile_active(total_tiles, 0);
+    if (!culled_ranks[mpi_rank]) {
+        tbb::parallel_for(0, total_tiles, [&](const int t) {
+            tile_active[t] = tile_has_active_pixels(img.data(), img_size.x, tile_bounds(t));
+        });
+    }
+
+    const int mask_bytes = (total_tiles + 7) / 8;
+    std::vector<uint8_t> local_mask(mask_bytes, 0);
+    for (int t = 0; t < total_tiles; ++t) {
+        local_mask[t / 8] |= tile_active[t] << (t % 8);
+    }
+    std::vector<uint8_t> tile_masks(mask_bytes * mpi_size, 0);
+    MPI_Allgather(local_mask.data(),
+                  mask_bytes,
+                  MPI_UINT8_T,
+                  tile_masks.data(),
+                  mask_bytes,
+                  MPI_UINT8_T,
+                  MPI_COMM_WORLD);
+
+    exchange_stats = ExchangeStats();
+    post_tile_receives<Pixel>(visible_order(composite_order), tile_masks);
+
+    // Send the tiles we cover to their owners
+    size_t send_size = 0;
+    for (int t = 0; t < total_tiles; ++t) {
+        if (tile_active[t] && tile_owner(t) != mpi_rank) {
+            const size_t tile_pixels =
+                (tile_bounds(t).upper - tile_bounds(t).lower).long_product();
+            send_size += max_encoded_size<Pixel>(tile_pixels, options);
+        }
+    }
+    if (send_buf.size() < send_size) {
+        send_buf.resize(send_size);
+    }
+    size_t send_offset = 0;
+    for (int t = 0; t < total_tiles; ++t) {
+        if (tile_active[t] && tile_owner(t) != mpi_rank) {
+            send_tile(img, t, true, send_offset);
+        }
+    }
+
+    for (auto &tile : owned_tile_pieces) {
+        if (tile_active[tile.id]) {
+            receive_own_piece(img, tile, true);
+        }
+        blend_arrived<Pixel>(tile);
+    }
+    finish_tiles<Pixel>();
+}
+
+template <typename Pixel>
+void DirectSendBackend::stream_tiles(const QueuedFrame &frame,
+                                     const std::vector<int> &composite_order,
+                                     std::vector<Pixel> &img,
+                                     ProfilingPoint &local_render_end)
+{
+    // We don't know which tiles the ranks cover until they're rendered, so every rank
+    // which wasn't culled sends every tile and the empty ones are sent as empty messages
+    exchange_stats = ExchangeStats();
+    post_tile_receives<Pixel>(visible_order(composite_order), std::vector<uint8_t>());
+    if (frame.culled) {
+        clear_local_image();
+        local_render_end = ProfilingPoint();
+        for (auto &tile : owned_tile_pieces) {
+            blend_arrived<Pixel>(tile);
+        }
+        finish_tiles<Pixel>();
+        return;
+    }
+
+    size_t send_size = 0;
+    for (int t = 0; t < n_tiles.long_product(); ++t) {
+        if (tile_owner(t) != mpi_rank) {
+            const size_t tile_pixels =
+                (tile_bounds(t).upper - tile_bounds(t).lower).long_product();
+            send_size += max_encoded_size<Pixel>(tile_pixels, options);
+        }
+    }
+    if (send_buf.size() < send_size) {
+        send_buf.resize(send_size);
+    }
+
+    // Each band is rendered by restricting the camera to its rows of the image
+    set_camera_view(band_camera, frame.view, img_size);
+    auto render_band = [&](const int band) {
+        const vec2i rows = min(band_tile_rows(band) * tile_size, vec2i(img_size.y));
+        band_camera.setParam("imageStart", vec2f(0.f, float(rows.x) / img_size.y));
+        band_camera.setParam("imageEnd", vec2f(1.f, float(rows.y) / img_size.y));
+        band_camera.commit();
+        return band_fbs[band].renderFrame(renderer, band_camera, frame.world);
+    };
+
+    size_t send_offset = 0;
+    cpp::Future band_render = render_band(0);
+    for (int b = 0; b < stream_bands; ++b) {
+        band_render.wait();
+        // Render the next band while this one's tiles are sent out
+        if (b + 1 < stream_bands) {
+            band_render = render_band(b + 1);
+        }
+
+        const vec2i tile_rows = band_tile_rows(b);
+        const vec2i rows = min(tile_rows * tile_size, vec2i(img_size.y));
+        read_local_render(band_fbs[b],
+                          size_t(rows.x) * img_size.x,
+                          size_t(rows.y - rows.x) * img_size.x);
+        if (b + 1 == stream_bands) {
+            local_render_end = ProfilingPoint();
+        }
+
+        const int first_tile = tile_rows.x * n_tiles.x;
+        const int band_tiles = (tile_rows.y - tile_rows.x) * n_tiles.x;
+        std::vector<uint8_t> tile_active(band_tiles, 0);
+        tbb::parallel_for(0, band_tiles, [&](const int i) {
+            tile_active[i] =
+                tile_has_active_pixels(img.data(), img_size.x, tile_bounds(first_tile + i));
+        });
+        for (int i = 0; i < band_tiles; ++i) {
+            if (tile_owner(first_tile + i) != mpi_rank) {
+                send_tile(img, first_tile + i, tile_active[i], send_offset);
+            }
+        }
+        for (auto &tile : owned_tile_pieces) {
+            if (tile.id >= first_tile && tile.id < first_tile + band_tiles) {
+                receive_own_piece(img, tile, tile_active[tile.id - first_tile]);
+                blend_arrived<Pixel>(tile);
+            }
+        }
+        blend_received<Pixel>(false);
+    }
+    finish_tiles<Pixel>();
+}
+
+template <typename Pixel>
+void DirectSendBackend::post_tile_receives(const std::vector<int> &composite_order,
+                                           const std::vector<uint8_t> &tile_masks)
+{
+    const int total_tiles = n_tiles.long_product();
+    const int mask_bytes = (total_tiles + 7) / 8;
+    if (owned_tiles.size() < owned_pixels * pixel_words<Pixel>()) {
+        owned_tiles.resize(owned_pixels * pixel_words<Pixel>());
+    }
+
+    owned_tile_pieces.clear();
+    size_t recv_size = 0;
+    size_t owned_offset = 0;
+    for (int t = mpi_rank; t < total_tiles; t += mpi_size) {
+        OwnedTile tile;
+        tile.id = t;
+        tile.bounds = tile_bounds(t);
+        tile.offset = owned_offset;
+        const size_t tile_pixels = (tile.bounds.upper - tile.bounds.lower).long_product();
+        owned_offset += tile_pixels;
+        for (const int r : composite_order) {
+            if (tile_masks.empty() || tile_masks[r * mask_bytes + t / 8] & (1 << (t % 8))) {
+                tile.senders.push_back(r);
+                tile.recv_offsets.push_back(recv_size);
+                recv_size += max_encoded_size<Pixel>(tile_pixels, options);
+            }
+        }
+        tile.arrived.resize(tile.senders.size(), false);
+        tile.empty.resize(tile.senders.size(), false);
+        owned_tile_pieces.push_back(tile);
+    }
+    if (recv_buf.size() < recv_size) {
+        recv_buf.resize(recv_size);
+    }
+
+    recv_requests.clear();
+    recv_ids.clear();
+    send_requests.clear();
+    for (size_t i = 0; i < owned_tile_pieces.size(); ++i) {
+        const auto &tile = owned_tile_pieces[i];
+        const size_t tile_pixels = (tile.bounds.upper - tile.bounds.lower).long_product();
+        for (size_t j = 0; j < tile.senders.size(); ++j) {
+            if (tile.senders[j] == mpi_rank) {
+                continue;
+            }
+            recv_requests.push_back(MPI_REQUEST_NULL);
+            recv_ids.emplace_back(i, j);
+            MPI_Irecv(recv_buf.data() + tile.recv_offsets[j],
+                      max_encoded_size<Pixel>(tile_pixels, options),
+                      MPI_UINT32_T,
+                      tile.senders[j],
+                      tile_tag(tile.id),
+                      MPI_COMM_WORLD,
+                      &recv_requests.back());
+        }
+    }
+}
+
+template <typename Pixel>
+void DirectSendBackend::receive_own_piece(const std::vector<Pixel> &img,
+                                          OwnedTile &tile,
+                                          const bool active)
+{
+    const size_t j =
+        std::find(tile.senders.begin(), tile.senders.end(), mpi_rank) - tile.senders.begin();
+    if (active) {
+        copy_tile(img.data(),
+                  img_size.x,
+                  tile.bounds,
+                  reinterpret_cast<Pixel *>(recv_buf.data() + tile.recv_offsets[j]));
+    }
+    tile.empty[j] = !active;
+    tile.arrived[j] = true;
+}
+
+template <typename Pixel>
+void DirectSendBackend::send_tile(const std::vector<Pixel> &img,
+                                  const int tile_id,
+                                  const bool active,
+                                  size_t &send_offset)
+{
+    const box2i bounds = tile_bounds(tile_id);
+    const size_t tile_pixels = (bounds.upper - bounds.lower).long_product();
+    size_t send_count = 0;
+    if (active) {
+        send_count = tile_pixels * pixel_words<Pixel>();
+        if (options.encoded()) {
+            if (tile_buf.size() < send_count) {
+                tile_buf.resize(send_count);
+            }
+            Pixel *tile_pixels_buf = reinterpret_cast<Pixel *>(tile_buf.data());
+            copy_tile(img.data(), img_size.x, bounds, tile_pixels_buf);
+            send_count = encode_pixels(
+                tile_pixels_buf, tile_pixels, options, send_buf.data() + send_offset);
+        } else {
+            copy_tile(img.data(),
+                      img_size.x,
+                      bounds,
+                      reinterpret_cast<Pixel *>(send_buf.data() + send_offset));
+        }
+        exchange_stats.raw_bytes += tile_pixels * sizeof(Pixel);
+        exchange_stats.sent_bytes += send_count * sizeof(uint32_t);
+    }
+
+    send_requests.push_back(MPI_REQUEST_NULL);
+    MPI_Isend(send_buf.data() + send_offset,
+              send_count,
+              MPI_UINT32_T,
+              tile_owner(tile_id),
+              tile_tag(tile_id),
+              MPI_COMM_WORLD,
+              &send_requests.back());
+    send_offset += max_encoded_size<Pixel>(tile_pixels, options);
+}
+
+template <typename Pixel>
+void DirectSendBackend::blend_arrived(OwnedTile &tile)
+{
+    const size_t tile_pixels = (tile.bounds.upper - tile.bounds.lower).long_product();
+    Pixel *composited = reinterpret_cast<Pixel *>(owned_tiles.data()) + tile.offset;
+    for (; tile.next_blend < tile.senders.size() && tile.arrived[tile.next_blend];
+         ++tile.next_blend) {
+        if (tile.empty[tile.next_blend]) {
+            continue;
+        }
+        const bool first = !tile.written;
+        tile.written = true;
+
+        const uint32_t *piece = recv_buf.data() + tile.recv_offsets[tile.next_blend];
+        // Our own piece of the tile is copied in without encoding it
+        const bool encoded = options.encoded() && tile.senders[tile.next_blend] != mpi_rank;
+        if (encoded) {
+            if (first) {
+                decode_pixels(piece, tile_pixels, options, composited);
+            } else {
+                blend_encoded_under(composited, piece, tile_pixels, options);
+            }
+            continue;
+        }
+        const Pixel *raw_piece = reinterpret_cast<const Pixel *>(piece);
+        if (first) {
+            std::copy(raw_piece, raw_piece + tile_pixels, composited);
+        } else {
+            blend_images(composited, raw_piece, composited, tile_pixels);
+        }
+    }
+}
+
+template <typename Pixel>
+bool DirectSendBackend::blend_received(const bool wait)
+{
+    std::vector<int> completed(recv_requests.size(), 0);
+    std::vector<MPI_Status> statuses(recv_requests.size());
+    int num_completed = 0;
+    if (wait) {
+        MPI_Waitsome(recv_requests.size(),
+                     recv_requests.data(),
+                     &num_completed,
+                     completed.data(),
+                     statuses.data());
+    } else {
+        MPI_Testsome(recv_requests.size(),
+                     recv_requests.data(),
+                     &num_completed,
+                     completed.data(),
+                     statuses.data());
+    }
+    if (num_completed == MPI_UNDEFINED) {
+        return false;
+    }
+    for (int i = 0; i < num_completed; ++i) {
+        const vec2i id = recv_ids[completed[i]];
+        OwnedTile &tile = owned_tile_pieces[id.x];
+        int count = 0;
+        MPI_Get_count(&statuses[i], MPI_UINT32_T, &count);
+        tile.empty[id.y] = count == 0;
+        tile.arrived[id.y] = true;
+        blend_arrived<Pixel>(tile);
+    }
+    return true;
+}
+
+template <typename Pixel>
+void DirectSendBackend::finish_tiles()
+{
+    while (blend_received<Pixel>(true)) {
+    }
+
+    // Tiles no rank covered are left empty
+    Pixel *composited_tiles = reinterpret_cast<Pixel *>(owned_tiles.data());
+    for (const auto &tile : owned_tile_pieces) {
+        if (!tile.written) {
+            const size_t tile_pixels = (tile.bounds.upper - tile.bounds.lower).long_product();
+            std::fill(composited_tiles + tile.offset,
+                      composited_tiles + tile.offset + tile_pixels,
+                      Pixel());
+        }
+    }
+    MPI_Waitall(send_requests.size(), send_requests.data(), MPI_STATUSES_IGNORE);
+}
+
+template <typename Pixel>
+void DirectSendBackend::gather_tiles(std::vector<Pixel> &out)
+{
+    Pixel *composited_tiles = reinterpret_cast<Pixel *>(owned_tiles.data());
+
+    // Each rank sends its tiles back to back as words, which rank 0 then writes into
+    // the image
+    std::vector<int> counts(mpi_size, 0);
+    std::vector<int> offsets(mpi_size, 0);
+    for (int t = 0; t < n_tiles.long_product(); ++t) {
+        const box2i bounds = tile_bounds(t);
+        counts[tile_owner(t)] +=
+            (bounds.upper - bounds.lower).long_product() * pixel_words<Pixel>();
+    }
+    for (int i = 1; i < mpi_size; ++i) {
+        offsets[i] = offsets[i - 1] + counts[i - 1];
+    }
+    const size_t img_words = img_size.long_product() * pixel_words<Pixel>();
+    if (mpi_rank == 0 && recv_buf.size() < img_words) {
+        recv_buf.resize(img_words);
+    }
+    MPI_Gatherv(composited_tiles,
+                owned_pixels * pixel_words<Pixel>(),
+                MPI_UINT32_T,
+                recv_buf.data(),
+                counts.data(),
+                offsets.data(),
+                MPI_UINT32_T,
+                0,
+                MPI_COMM_WORLD);
+
+    if (mpi_rank == 0) {
+        const Pixel *tiles = reinterpret_cast<const Pixel *>(recv_buf.data());
+        std::vector<int> read_offsets(mpi_size, 0);
+        for (int i = 0; i < mpi_size; ++i) {
+            read_offsets[i] = offsets[i] / pixel_words<Pixel>();
+        }
+        for (int t = 0; t < n_tiles.long_product(); ++t) {
+            const box2i bounds = tile_bounds(t);
+            const int owner = tile_owner(t);
+            write_tile(tiles + read_offsets[owner], bounds, out.data(), img_size.x);
+            read_offsets[owner] += (bounds.upper - bounds.lower).long_product();
+        }
+    }
+}
+
+std::vector<box2i> DirectSendBackend::owned_regions() const
+{
+    // The owned tiles are stored back to back in tile order
+    std::vector<box2i> regions;
+    for (int t = mpi_rank; t < n_tiles.long_product(); t += mpi_size) {
+        regions.push_back(tile_bounds(t));
+    }
+    return regions;
+}
+
+void *DirectSendBackend::owned_image_data()
+{
+    return owned_tiles.data();
+}
+
+int DirectSendBackend::tile_owner(const int tile_id) const
+{
+    return tile_id % mpi_size;
+}
+
+int DirectSendBackend::tile_tag(const int tile_id) const
+{
+    return (tile_id / mpi_size) % (tag_ub + 1);
+}
+
+box2i DirectSendBackend::tile_bounds(const int tile_id) const
+{
+    const vec2i lower = vec2i(tile_id % n_tiles.x, tile_id / n_tiles.x) * tile_size;
+    return box2i(lower, min(lower + vec2i(tile_size), img_size));
+}
+
+vec2i DirectSendBackend::band_tile_rows(const int band) const
+{
+    return vec2i(band * n_tiles.y / stream_bands, (band + 1) * n_tiles.y / stream_bands);
+}
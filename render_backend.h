@@ -4,14 +4,46 @@
 #include <IceT.h>
 #include <IceTMPI.h>
 #endif
+#include <array>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mpi.h>
 #include <ospray/ospray_cpp.h>
 #include <ospray/ospray_cpp/ext/rkcommon.h>
+#include <rkcommon/math/box.h>
+#include "compositing.h"
 #include "json.hpp"
+#include "loader.h"
+#include "profiling.h"
 
 using json = nlohmann::json;
 using namespace ospray;
 using namespace rkcommon::math;
 
+/* A display wall made of a grid of tiles evenly covering the image, each shown by its
+ * display rank. The display ranks receive only their tile of the final image instead
+ * of rank 0 receiving the whole image. Each rank displays at most one tile
+ */
+struct DisplayWall {
+    std::vector<box2i> tiles;
+    std::vector<int> display_ranks;
+
+    DisplayWall() = default;
+
+    // The tiles are listed row by row from the bottom of the image, matching the
+    // framebuffer's rows
+    DisplayWall(const vec2i &img_size,
+                const vec2i &grid,
+                const std::vector<int> &display_ranks,
+                const int num_ranks);
+
+    bool empty() const;
+
+    // The tile displayed by the rank, or -1 if it doesn't display one
+    int rank_tile(const int rank) const;
+};
+
 struct RenderBackend {
     vec2i img_size;
     cpp::FrameBuffer fb;
@@ -19,21 +51,105 @@ struct RenderBackend {
     int mpi_rank;
     int mpi_size;
     vec3f bg_color;
+    // Leave the final image distributed over the ranks owning its pieces instead of
+    // gathering it to rank 0, so the frames can only be saved with write_frame
+    bool distributed_output = false;
+    // The time taken by this rank's local rendering of the last frame, in milliseconds
+    double local_render_time = 0.0;
+    // The number of views stacked as layers of the image when rendering batched views
+    int num_layers = 1;
 
     RenderBackend(const vec2i &img_size, bool detailed_cpu_stats, const vec3f &bg_color);
 
     virtual ~RenderBackend() = default;
 
-    // Render returns the total render time in milliseconds
+    /* Render returns the total render time in milliseconds. The view is the camera's
+     * placement, used for the composite order. If this rank's brick was culled it
+     * doesn't render anything and contributes an empty image
+     */
     virtual size_t render(const cpp::Camera &camera,
                           const cpp::World &world,
-                          const vec3f &cam_pos) = 0;
+                          const Camera &view,
+                          const bool culled) = 0;
+
+    /* Queue a frame for pipelined rendering, where the local rendering of the next
+     * queued frame overlaps compositing the current one. Backends which don't
+     * pipeline frames just render the frame when it's finished
+     */
+    virtual void queue_frame(const cpp::Camera &camera,
+                             const cpp::World &world,
+                             const Camera &view,
+                             const bool culled);
+
+    /* Finish the oldest queued frame, after which its image can be mapped. Returns
+     * the frame's render time in milliseconds
+     */
+    virtual size_t finish_frame();
+
+    // Whether queued frames are rendered ahead of being composited, by default they're
+    // just rendered when they're finished
+    virtual bool pipelines_frames() const;
+
+    /* Render up to num_layers views as the layers of one frame, stacked from the bottom
+     * of the image, so they're composited together in a single exchange. The cameras
+     * must have the same composite order as the view, and any layers without a camera
+     * are left empty. Returns the frame's render time in milliseconds. Only supported by
+     * the native compositors
+     */
+    virtual size_t render_layers(const std::vector<cpp::Camera> &cameras,
+                                 const cpp::World &world,
+                                 const Camera &view,
+                                 const bool culled);
 
     virtual const uint32_t *map_fb() = 0;
 
     virtual void unmap_fb(const uint32_t *mapping) = 0;
+
+    /* Write the last finished frame to a binary PPM file with MPI-IO, collective over
+     * all ranks. Rank 0 writes the header, and each rank writes the pieces of the image
+     * it owns. By default rank 0 writes the whole image from map_fb
+     */
+    virtual void write_frame(const std::string &fname);
+
+    // Update the volume decomposition used for the composite order after rebalancing
+    virtual void set_volume_tree(const KdTree &tree);
+
+    /* Send each tile of the final image to its display rank, where map_fb returns the
+     * tile's pixels instead of the whole image. Only supported by the backends which
+     * return true
+     */
+    virtual bool set_display_wall(const DisplayWall &wall);
+
+protected:
+    /* Write this rank's regions of the image to the PPM file, with their RGBA8 pixels
+     * stored region by region in row-major order. Collective over all ranks
+     */
+    void write_ppm(const std::string &fname,
+                   const std::vector<box2i> &regions,
+                   const uint32_t *pixels) const;
+
+    struct QueuedFrame {
+        cpp::Camera camera;
+        // The views rendered as layers of the image, instead of the camera's view
+        std::vector<cpp::Camera> layer_cameras;
+        cpp::World world;
+        Camera view;
+        bool culled = false;
+        // Set once the frame's local rendering has been started
+        bool started = false;
+        ProfilingPoint start;
+        cpp::Future render;
+    };
+    std::deque<QueuedFrame> queued_frames;
 };
 
+/* Walk the k-d tree front-to-back from the camera position and return the ranks
+ * owning the bricks in that order, with each rank listed once
+ */
+std::vector<int> compute_composite_order(const KdTree &volume_tree,
+                                         const BrickPlacement &placement,
+                                         const vec3f &cam_pos);
+
 struct OSPRayDFBBackend : RenderBackend {
     cpp::Renderer renderer;
 
@@ -41,38 +157,125 @@ struct OSPRayDFBBackend : RenderBackend {
 
     size_t render(const cpp::Camera &camera,
                   const cpp::World &world,
-                  const vec3f &cam_pos) override;
+                  const Camera &view,
+                  const bool culled) override;
 
     const uint32_t *map_fb() override;
 
     void unmap_fb(const uint32_t *mapping) override;
 };
 
+/* Sort-first rendering of replicated data. The image is split into tiles and each
+ * rank starts with a contiguous range of them. The next unclaimed tile of each rank's
+ * range is a counter in an MPI window, which the ranks claim tiles from with atomic
+ * fetch-and-add. Ranks which finish their own range steal tiles from the others the
+ * same way, and the rendered tiles are gathered into the final image on rank 0.
+ */
+struct ImageParallelBackend : RenderBackend {
+    cpp::Renderer renderer;
+    // The camera restricted to each tile as it's rendered, so the caller's camera is left
+    // untouched
+    cpp::Camera tile_camera;
+    int tile_size;
+    vec2i n_tiles;
+
+    // The tiles rendered and stolen by this rank in the last frame
+    int tiles_rendered = 0;
+    int tiles_stolen = 0;
+
+    ImageParallelBackend(const vec2i &img_size,
+                         bool detailed_cpu_stats,
+                         const vec3f &bg_color,
+                         const int tile_size);
+
+    ~ImageParallelBackend();
+
+    ImageParallelBackend(const ImageParallelBackend &) = delete;
+    ImageParallelBackend &operator=(const ImageParallelBackend &) = delete;
+
+    size_t render(const cpp::Camera &camera,
+                  const cpp::World &world,
+                  const Camera &view,
+                  const bool culled) override;
+
+    const uint32_t *map_fb() override;
+
+    void unmap_fb(const uint32_t *mapping) override;
+
+private:
+    // The window holding the next unclaimed tile of this rank's range
+    MPI_Win window = MPI_WIN_NULL;
+    int *next_tile = nullptr;
+
+    // The framebuffers for each size of tile, which only differ at the image's edges
+    std::map<std::pair<int, int>, cpp::FrameBuffer> tile_fbs;
+
+    // The tiles rendered by this rank and their pixels, stored one after the other
+    std::vector<int> rendered_ids;
+    std::vector<uint32_t> rendered_pixels;
+    // The final image, only valid on rank 0
+    std::vector<uint32_t> final_img;
+
+    // The [begin, end) range of tiles initially owned by the rank
+    vec2i rank_tiles(const int rank) const;
+
+    // Reset this rank's counter to the start of its range of tiles
+    void reset_tiles();
+
+    // Claim the next tile of the rank's range, returns -1 if they've all been claimed
+    int claim_tile(const int rank);
+
+    // The [lower, upper) pixel bounds of the tile
+    box2i tile_bounds(const int tile_id) const;
+
+    void gather_tiles();
+};
+
 #if ICET_ENABLED
 struct IceTBackend : RenderBackend {
     cpp::Renderer renderer;
+    // The camera restricted to the region covered by the rank's bricks, so the caller's
+    // camera is left untouched
+    cpp::Camera region_camera;
     IceTCommunicator icet_comm;
     IceTContext icet_context;
     IceTImage icet_img;
 
     const cpp::World *world = nullptr;
-    const cpp::Camera *camera = nullptr;
 
-    struct BrickInfo {
-        vec3i pos;
-        vec3i dims;
-        int owner;
-        float max_distance;
+    // The volume decomposition and placement of the bricks, used to determine the
+    // visibility order of the ranks
+    KdTree volume_tree;
+    BrickPlacement brick_placement;
 
-        BrickInfo(const vec3i &pos, const vec3i &dims, int owner);
+    // Render through IceT's draw callback, copying the framebuffer into IceT's image,
+    // instead of passing the mapped framebuffer to icetCompositeImage directly
+    bool use_draw_callback = false;
+    // The time spent handing the local rendering to IceT in the last frame, in
+    // milliseconds
+    double handoff_time = 0.0;
+    // The time IceT spent in its draw or composite call in the last frame, in
+    // milliseconds
+    double draw_time = 0.0;
+    // Whether this rank's brick was culled in the frame being rendered, and the empty
+    // image composited in place of the local rendering when it is
+    bool frame_culled = false;
+    std::vector<uint8_t> empty_img;
 
-        BrickInfo() = default;
-    };
-
-    std::vector<BrickInfo> volume_bricks;
+    // The perspective camera's vertical field of view in degrees, used to project the
+    // rank's bricks onto the image
+    float fovy = 60.f;
+    // The region of the image covered by the rank's bricks in the frame being rendered,
+    // the local rendering is restricted to it
+    box2i render_region;
+    // The framebuffers for each size of region rendered, and the image the region is
+    // copied into for IceT when it doesn't cover the whole image
+    std::map<std::pair<int, int>, cpp::FrameBuffer> region_fbs;
+    std::vector<uint8_t> region_img;
 
     IceTBackend(const vec2i &img_size,
                 const vec3i &volume_dims,
+                const int bricks_per_rank,
                 bool detailed_cpu_stats,
                 const vec3f &bg_color);
 
@@ -80,18 +283,36 @@ struct IceTBackend : RenderBackend {
 
     size_t render(const cpp::Camera &camera,
                   const cpp::World &world,
-                  const vec3f &cam_pos) override;
+                  const Camera &view,
+                  const bool culled) override;
 
     const uint32_t *map_fb() override;
 
     void unmap_fb(const uint32_t *mapping) override;
 
+    void set_volume_tree(const KdTree &tree) override;
+
+    bool set_display_wall(const DisplayWall &wall) override;
+
+    /* Set IceT's single image strategy by name, one of AUTOMATIC, BSWAP, RADIXK or TREE.
+     * Returns false if the name isn't one of them
+     */
+    bool set_single_image_strategy(const std::string &name);
+
 private:
-    void compute_brick_grid(const vec3i &volume_dims);
+    /* Set the rank's bricks as IceT's bounds and compute the projection and modelview
+     * matrices of the view, returning the region of the image the bricks cover. When
+     * the bricks can't be projected, e.g. the camera is inside them, the bounds and
+     * region cover the whole image
+     */
+    box2i set_view_bounds(const Camera &view,
+                          std::array<double, 16> &proj_mat,
+                          std::array<double, 16> &modelview_mat);
 
-    float brick_distance(const BrickInfo &brick, const vec3f &p);
+    // Render the region of the image into the RGBA8 image, which is img_size
+    void render_local_region(const box2i &region, uint8_t *img);
 
-    void draw_callback(IceTImage &result);
+    void draw_callback(IceTImage &result, const int *readback_viewport);
 
     static void icet_draw_callback(const double *proj_mat,
                                    const double *modelview_mat,
@@ -100,3 +321,463 @@ private:
                                    IceTImage result);
 };
 #endif
+
+/* Renders locally with OSPRay and composites the partial images directly on
+ * MPI, in the visibility order of the bricks. The compositing algorithm is
+ * provided by the derived backends, which composite in each of the pixel formats.
+ */
+struct NativeCompositorBackend : RenderBackend {
+    cpp::Renderer renderer;
+
+    // The volume decomposition and placement of the bricks, used to determine the
+    // visibility order of the ranks
+    KdTree volume_tree;
+    BrickPlacement brick_placement;
+
+    // The local rendering in the exchanged pixel format, which is also used as the
+    // compositing buffer. Only the buffer for the pixel format being used is allocated
+    std::vector<uint32_t> local_img;
+    std::vector<RGBA16F> local_img_half;
+    std::vector<vec4f> local_img_float;
+    // The final composited image, only valid on rank 0
+    std::vector<uint32_t> final_img;
+    // The tile of the image shown by this rank on the display wall, if any
+    DisplayWall display_wall;
+    std::vector<uint32_t> display_img;
+    // The final composited image in linear color for the float pixel formats, only
+    // valid on rank 0
+    std::vector<vec4f> final_img_float;
+
+    CompositeOptions options;
+    // The partial image data sent by this rank in the last frame
+    ExchangeStats exchange_stats;
+    // Whether each rank's brick was culled in the frame being composited
+    std::vector<int> culled_ranks;
+
+    NativeCompositorBackend(const vec2i &img_size,
+                            const vec3i &volume_dims,
+                            const int bricks_per_rank,
+                            bool detailed_cpu_stats,
+                            const vec3f &bg_color,
+                            const CompositeOptions &options);
+
+    // Renders the frame immediately, finishing any earlier queued frames first
+    size_t render(const cpp::Camera &camera,
+                  const cpp::World &world,
+                  const Camera &view,
+                  const bool culled) override;
+
+    void queue_frame(const cpp::Camera &camera,
+                     const cpp::World &world,
+                     const Camera &view,
+                     const bool culled) override;
+
+    size_t finish_frame() override;
+
+    size_t render_layers(const std::vector<cpp::Camera> &cameras,
+                         const cpp::World &world,
+                         const Camera &view,
+                         const bool culled) override;
+
+    const uint32_t *map_fb() override;
+
+    void unmap_fb(const uint32_t *mapping) override;
+
+    void write_frame(const std::string &fname) override;
+
+    void set_volume_tree(const KdTree &tree) override;
+
+    bool set_display_wall(const DisplayWall &wall) override;
+
+protected:
+    // The name of the compositor to print in the statistics
+    virtual std::string name() const = 0;
+
+    /* Composite the local image with those of the other ranks, given the ranks in
+     * front-to-back order
+     */
+    virtual void composite(const std::vector<int> &composite_order,
+                           std::vector<uint32_t> &img) = 0;
+    virtual void composite(const std::vector<int> &composite_order,
+                           std::vector<RGBA16F> &img) = 0;
+    virtual void composite(const std::vector<int> &composite_order,
+                           std::vector<vec4f> &img) = 0;
+
+    // Gather the pieces of the composited image owned by each rank into out on rank 0
+    virtual void gather_image(std::vector<uint32_t> &img, std::vector<uint32_t> &out) = 0;
+    virtual void gather_image(std::vector<RGBA16F> &img, std::vector<RGBA16F> &out) = 0;
+    virtual void gather_image(std::vector<vec4f> &img, std::vector<vec4f> &out) = 0;
+
+    /* The regions of the final image owned by this rank after compositing, and their
+     * pixels in the exchanged pixel format, stored region by region in row-major order
+     */
+    virtual std::vector<box2i> owned_regions() const = 0;
+    virtual void *owned_image_data() = 0;
+
+    // The time taken by each round of compositing in the last frame, if applicable
+    virtual std::vector<double> round_times() const;
+
+    // Blend the background color under the composited pixels
+    void blend_background(uint32_t *pixels, const size_t n) const;
+    void blend_background(RGBA16F *pixels, const size_t n) const;
+    void blend_background(vec4f *pixels, const size_t n) const;
+
+    /* Render the frame's local image and composite it, setting local_render_end once
+     * the local rendering is done. By default the whole frame is rendered before
+     * compositing starts, and the next queued frame is started rendering while this
+     * one is composited
+     */
+    virtual void render_composite(QueuedFrame &frame,
+                                  const std::vector<int> &composite_order,
+                                  ProfilingPoint &local_render_end);
+
+    // Whether frames are rendered to the framebuffer ahead of being composited
+    bool pipelines_frames() const override;
+
+    // Whether OSPRay renders to an RGBA32F framebuffer instead of SRGBA
+    bool renders_float() const;
+
+    // The composite order without the ranks culled in this frame
+    std::vector<int> visible_order(const std::vector<int> &composite_order) const;
+
+    // Clear the local image when this rank's brick was culled and nothing was rendered
+    void clear_local_image();
+
+    /* Copy the n pixels rendered to the framebuffer into the local image in the
+     * exchanged pixel format, starting at the offset
+     */
+    void read_local_render(cpp::FrameBuffer &src, const size_t offset, const size_t n);
+
+    /* Composite and gather the local image in the exchanged pixel format. Reference
+     * composites are only gathered to rank 0, the display ranks keep the frame's tiles
+     */
+    void composite_frame(const std::vector<int> &composite_order,
+                         const bool reference = false);
+
+    /* Blend the background under the owned pieces of the composited image and gather
+     * them into the final image on rank 0, or send them to the display ranks of their
+     * tiles, unless the output is distributed. Reference composites aren't sent to the
+     * display ranks
+     */
+    void gather_frame(const bool reference = false);
+
+    /* Send the owned pieces of each display wall tile, converted to RGBA8, to the tile's
+     * display rank which assembles them into its display image
+     */
+    void send_display_tiles();
+
+private:
+    // The framebuffer the next frame is rendered to while the current one is read back
+    cpp::FrameBuffer back_fb;
+    bool back_fb_allocated = false;
+    // The framebuffer each layer of a batched frame is rendered to
+    cpp::FrameBuffer layer_fb;
+    bool layer_fb_allocated = false;
+
+    // The RGBA32F rendering, kept when compositing reference images of the frame
+    std::vector<vec4f> float_render;
+    std::vector<RGBA16F> final_img_half;
+
+    /* The owned pixels of the composited image in RGBA8, with the float formats
+     * converted to sRGB into converted
+     */
+    const uint32_t *owned_rgba8_pixels(std::vector<uint32_t> &converted);
+
+    // Whether the RGBA32F rendering is kept for the reference composites
+    bool keeps_float_render() const;
+
+    // The reference composites overwrite the owned pieces of the image, so the final
+    // image is still gathered when computing them even if the output is distributed
+    bool gathers_frame() const;
+
+    // Start the local rendering of the frame to the framebuffer
+    void start_render(QueuedFrame &frame);
+
+    // Render each layer of the batched frame and read it into its layer of the local image
+    void render_local_layers(const QueuedFrame &frame);
+
+    // Allocate the local and final images used when compositing in the pixel format
+    void allocate_images(const PixelFormat format);
+
+    // Convert the linear float rendering into the local image in the exchanged pixel format
+    void load_local_image(const vec4f *img, const size_t offset, const size_t n);
+
+    /* Composite the same frame losslessly in the reference pixel format and compute
+     * the error of the frame's final image against it on rank 0. Returns the RMSE,
+     * max error and PSNR of the color
+     */
+    vec3f compare_to_reference(const std::vector<int> &composite_order,
+                               const PixelFormat reference_format);
+};
+
+/* Compositors run as a schedule of rounds merging groups of ranks, where each
+ * rank ends up owning a contiguous range of the final image.
+ */
+struct ScheduleCompositorBackend : NativeCompositorBackend {
+    ScheduleCompositor compositor;
+
+    // When compositing node-local images first, the node compositor and the compositor
+    // running the schedule across the node leaders
+    std::unique_ptr<NodeCompositor> node_compositor;
+    ScheduleCompositor leader_compositor;
+
+    // The [begin, end) range of pixels of the final image owned by this rank
+    vec2i owned_range;
+
+    /* The derived backends set the compositor's schedule for the number of ranks, and
+     * the leader compositor's for the number of nodes
+     */
+    ScheduleCompositorBackend(const vec2i &img_size,
+                              const vec3i &volume_dims,
+                              const int bricks_per_rank,
+                              bool detailed_cpu_stats,
+                              const vec3f &bg_color,
+                              const CompositeOptions &options);
+
+    ~ScheduleCompositorBackend();
+
+protected:
+    // The compositing schedule for the number of ranks
+    virtual std::vector<CompositeRound> make_schedule(const int num_ranks) const = 0;
+
+    void composite(const std::vector<int> &composite_order,
+                   std::vector<uint32_t> &img) override;
+    void composite(const std::vector<int> &composite_order,
+                   std::vector<RGBA16F> &img) override;
+    void composite(const std::vector<int> &composite_order,
+                   std::vector<vec4f> &img) override;
+
+    void gather_image(std::vector<uint32_t> &img, std::vector<uint32_t> &out) override;
+    void gather_image(std::vector<RGBA16F> &img, std::vector<RGBA16F> &out) override;
+    void gather_image(std::vector<vec4f> &img, std::vector<vec4f> &out) override;
+
+    std::vector<box2i> owned_regions() const override;
+    void *owned_image_data() override;
+
+    std::vector<double> round_times() const override;
+
+    // The number of nodes the leader compositor's schedule is run over
+    int num_nodes() const;
+
+private:
+    // Whether the last frame was composited node-local first
+    bool composited_node_local = false;
+    bool warned_not_contiguous = false;
+    // The ranks which weren't culled, which the compositor's schedule is run over
+    std::vector<int> active_ranks;
+
+    // Rebuild the compositor's communicator and schedule if the culled ranks changed
+    void update_active_ranks();
+
+    template <typename Pixel>
+    void composite_pixels(const std::vector<int> &composite_order, std::vector<Pixel> &img);
+
+    template <typename Pixel>
+    void gather_pixels(std::vector<Pixel> &img, std::vector<Pixel> &out);
+};
+
+/* Binary swap compositing, non power of two rank counts are handled by folding
+ * the extra ranks' images into their neighbor in the visibility order first.
+ */
+struct BinarySwapBackend : ScheduleCompositorBackend {
+    BinarySwapBackend(const vec2i &img_size,
+                      const vec3i &volume_dims,
+                      const int bricks_per_rank,
+                      bool detailed_cpu_stats,
+                      const vec3f &bg_color,
+                      const CompositeOptions &options);
+
+protected:
+    std::string name() const override;
+
+    std::vector<CompositeRound> make_schedule(const int num_ranks) const override;
+};
+
+/* Radix-k compositing with the group size of each round taken from the k-values
+ * given, see radix_k_schedule for how these are fit to the number of ranks.
+ */
+struct RadixKBackend : ScheduleCompositorBackend {
+    std::vector<int> k_values;
+
+    RadixKBackend(const vec2i &img_size,
+                  const vec3i &volume_dims,
+                  const int bricks_per_rank,
+                  bool detailed_cpu_stats,
+                  const vec3f &bg_color,
+                  const CompositeOptions &options,
+                  const std::vector<int> &k_values);
+
+protected:
+    std::string name() const override;
+
+    std::vector<CompositeRound> make_schedule(const int num_ranks) const override;
+};
+
+/* 2-3 swap compositing, which stays balanced for rank counts which are not
+ * powers of two, see two_three_swap_schedule.
+ */
+struct TwoThreeSwapBackend : ScheduleCompositorBackend {
+    TwoThreeSwapBackend(const vec2i &img_size,
+                        const vec3i &volume_dims,
+                        const int bricks_per_rank,
+                        bool detailed_cpu_stats,
+                        const vec3f &bg_color,
+                        const CompositeOptions &options);
+
+protected:
+    std::string name() const override;
+
+    std::vector<CompositeRound> make_schedule(const int num_ranks) const override;
+};
+
+/* Direct-send compositing. The image is split into tiles which are assigned
+ * round-robin to the ranks, and each rank sends the tiles its partial image
+ * covers to their owners. The owners blend the tiles in the composite order
+ * as they arrive. When streaming, the frame is rendered in bands of tile rows
+ * and each band's tiles are sent out while the next band renders.
+ */
+struct DirectSendBackend : NativeCompositorBackend {
+    int tile_size;
+    vec2i n_tiles;
+    // The number of bands of tile rows the frame is rendered in, 1 if the whole
+    // frame is rendered before compositing
+    int stream_bands;
+
+    // The number of pixels in the tiles owned by this rank
+    size_t owned_pixels = 0;
+    // The composited tiles owned by this rank, stored one after the other as words of
+    // the exchanged pixel format
+    std::vector<uint32_t> owned_tiles;
+
+    DirectSendBackend(const vec2i &img_size,
+                      const vec3i &volume_dims,
+                      const int bricks_per_rank,
+                      bool detailed_cpu_stats,
+                      const vec3f &bg_color,
+                      const CompositeOptions &options,
+                      const int tile_size,
+                      const int stream_bands);
+
+protected:
+    std::string name() const override;
+
+    void render_composite(QueuedFrame &frame,
+                          const std::vector<int> &composite_order,
+                          ProfilingPoint &local_render_end) override;
+
+    // Frames rendered in bands aren't pipelined, as their bands are rendered as they're
+    // composited
+    bool pipelines_frames() const override;
+
+    void composite(const std::vector<int> &composite_order,
+                   std::vector<uint32_t> &img) override;
+    void composite(const std::vector<int> &composite_order,
+                   std::vector<RGBA16F> &img) override;
+    void composite(const std::vector<int> &composite_order,
+                   std::vector<vec4f> &img) override;
+
+    void gather_image(std::vector<uint32_t> &img, std::vector<uint32_t> &out) override;
+    void gather_image(std::vector<RGBA16F> &img, std::vector<RGBA16F> &out) override;
+    void gather_image(std::vector<vec4f> &img, std::vector<vec4f> &out) override;
+
+    std::vector<box2i> owned_regions() const override;
+    void *owned_image_data() override;
+
+private:
+    // The ranks sending pieces of a tile we own in front-to-back order, along with
+    // where their pieces are received and whether each has arrived yet
+    struct OwnedTile {
+        int id;
+        box2i bounds;
+        size_t offset;
+        std::vector<int> senders;
+        std::vector<size_t> recv_offsets;
+        std::vector<bool> arrived;
+        // Pieces sent as empty messages as they had no active pixels
+        std::vector<bool> empty;
+        size_t next_blend = 0;
+        // Whether any piece has been written to the composited tile yet
+        bool written = false;
+    };
+    std::vector<OwnedTile> owned_tile_pieces;
+    std::vector<MPI_Request> recv_requests;
+    // The owned tile and sender index each receive request is for
+    std::vector<vec2i> recv_ids;
+    std::vector<MPI_Request> send_requests;
+
+    std::vector<uint32_t> send_buf;
+    std::vector<uint32_t> recv_buf;
+    // Scratch space for copying out tiles to be encoded
+    std::vector<uint32_t> tile_buf;
+
+    // The framebuffer each band is rendered to when streaming, and the camera restricted
+    // to each band's rows so the queued frame's camera is left untouched
+    std::vector<cpp::FrameBuffer> band_fbs;
+    cpp::Camera band_camera;
+
+    // The largest message tag supported by MPI
+    int tag_ub = 32767;
+
+    template <typename Pixel>
+    void composite_tiles(const std::vector<int> &composite_order,
+                         const std::vector<Pixel> &img);
+
+    template <typename Pixel>
+    void stream_tiles(const QueuedFrame &frame,
+                      const std::vector<int> &composite_order,
+                      std::vector<Pixel> &img,
+                      ProfilingPoint &local_render_end);
+
+    /* Find the ranks sending each tile we own and post the receives for their pieces,
+     * given the mask of tiles covered by each rank. If the masks are empty every rank
+     * sends every tile, with an empty message for tiles it doesn't cover
+     */
+    template <typename Pixel>
+    void post_tile_receives(const std::vector<int> &composite_order,
+                            const std::vector<uint8_t> &tile_masks);
+
+    // Copy our own piece of the tile in from the local image, or mark it empty
+    template <typename Pixel>
+    void receive_own_piece(const std::vector<Pixel> &img, OwnedTile &tile, const bool active);
+
+    // Encode the tile of the local image and send it to its owner, at the offset in send_buf
+    template <typename Pixel>
+    void send_tile(const std::vector<Pixel> &img,
+                   const int tile_id,
+                   const bool active,
+                   size_t &send_offset);
+
+    /* Blend the tile's pieces which have arrived, as long as all the pieces in front
+     * of them have been blended already
+     */
+    template <typename Pixel>
+    void blend_arrived(OwnedTile &tile);
+
+    /* Blend the pieces received since the last call, waiting for at least one if
+     * wait is set. Returns false once all the pieces have been received
+     */
+    template <typename Pixel>
+    bool blend_received(const bool wait);
+
+    // Receive and blend the remaining pieces and wait for our sends to complete
+    template <typename Pixel>
+    void finish_tiles();
+
+    template <typename Pixel>
+    void gather_tiles(std::vector<Pixel> &out);
+
+    int tile_owner(const int tile_id) const;
+
+    /* The tag of the messages sending the tile's pieces, which is the tile's index among
+     * its owner's tiles wrapped to MPI_TAG_UB. The pieces sent between two ranks with
+     * the same tag are matched by their order, as both sides go through the tiles in
+     * order
+     */
+    int tile_tag(const int tile_id) const;
+
+    // The [lower, upper) pixel bounds of the tile
+    box2i tile_bounds(const int tile_id) const;
+
+    // The [begin, end) tile rows of the band
+    vec2i band_tile_rows(const int band) const;
+};
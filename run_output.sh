@@ -15,7 +15,11 @@ source $REPO_ROOT/set_ospray_vars.sh
 JOBID="${SLURM_JOBID}${COBALT_JOBID}"
 NPROCS="${SLURM_NNODES}${COBALT_PARTSIZE}"
 
-compositors=(dfb icet)
+if [ -n "$COMPOSITORS" ]; then
+	compositors=($COMPOSITORS)
+else
+	compositors=(dfb icet bswap radixk twothree directsend)
+fi
 for c in "${compositors[@]}"; do
 	export LOGFILE="bench-${c}-${NPROCS}n-${SLURM_JOB_PARTITION}-${JOBID}.txt"
 	export JOB_PREFIX="${SLURM_JOB_PARTITION}-${NPROCS}-${JOBID}-${c}"
@@ -2,6 +2,13 @@
 
 # Usage:
 # ./submit_compositing_scaling <queue>
+#
+# The radix-k k-values can be tuned for each machine by setting OSP_RADIX_K,
+# e.g. OSP_RADIX_K=8,8,4. If unset they are picked to be close to 8 for
+# each node count.
+#
+# The node counts and compositors to run can be overridden by setting
+# NODE_COUNTS and COMPOSITORS, e.g. NODE_COUNTS="96 1000" COMPOSITORS="icet twothree"
 
 if [ -z "$IMAGE_SIZE_X" ] || [ -z "$IMAGE_SIZE_Y" ]; then
 	export IMAGE_SIZE_X=2048
@@ -53,6 +60,10 @@ elif [ "`hostname | head -c 5`" == "theta" ]; then
 	fi
 fi
 
+if [ -n "$OSP_RADIX_K" ]; then
+	echo "Using radix-k k-values ${OSP_RADIX_K} on ${MACHINE}"
+fi
+
 if [ -z "$BUILD_DIR" ]; then
 	echo "Set the BUILD_DIR var!"
 	exit 1
@@ -94,6 +105,11 @@ else
 	exit 1
 fi
 
+if [ -n "$NODE_COUNTS" ]; then
+	echo "Using node counts from command line ${NODE_COUNTS}"
+	node_counts=($NODE_COUNTS)
+fi
+
 for i in "${node_counts[@]}"; do
 	if [ -n "$PREFIX" ]; then
 		export job_title="${PREFIX}-bench_${i}n_${IMAGE_SIZE_X}x${IMAGE_SIZE_Y}"
@@ -131,6 +147,8 @@ for i in "${node_counts[@]}"; do
 			--env "THETA_JOBNAME=$job_title" \
 			--env "OSPRAY_DP_API_TRACING=$OSPRAY_DP_API_TRACING" \
 			--env "PREFIX=$PREFIX" \
+			--env "OSP_RADIX_K=$OSP_RADIX_K" \
+			--env "COMPOSITORS=$COMPOSITORS" \
 			--env "SCRIPT_DIR=$SCRIPT_DIR" \
 			--env "REPO_ROOT=$REPO_ROOT" \
 			--env "SCRATCH=$SCRATCH" \
@@ -0,0 +1,18 @@
+#!/bin/bash
+
+# Usage:
+# ./submit_npot_scaling <queue>
+#
+# Compare 2-3 swap with IceT's automatic strategy and the power of two
+# compositors at node counts which are not powers of two
+
+if [ -z "$NODE_COUNTS" ]; then
+	export NODE_COUNTS="12 24 96 1000"
+fi
+export COMPOSITORS="icet twothree bswap radixk"
+
+# Make sure IceT picks its strategy automatically
+unset OSP_ICET_STRATEGY
+
+SCRIPT_DIR=$(dirname $(readlink -f $0))
+${SCRIPT_DIR}/submit_compositing_scaling.sh $@